@@ -0,0 +1,603 @@
+/**
+ * bench.cpp
+ *
+ * Micro-benchmarks for the decoder, the code pool, bridge creation and
+ * calls through probes, so changes to any of them can be measured
+ * instead of guessed at.
+ *
+ * Linux only. There's no project for it; build it from this directory
+ * with something like:
+ *
+ *   g++ -O2 -I.. bench.cpp ../bridgebuilder.cpp ../mem/codepool.cpp \
+ *       ../hook/hook.cpp ../hook/probe.cpp -lpthread -ldl -o bench
+ *
+ * and run it as
+ *
+ *   ./bench [--json] [--filter=text] [--min-time=seconds]
+ *
+ * Every benchmark is run with more and more iterations until it takes
+ * at least --min-time (0.5 by default), and reports the time per item:
+ * per instruction decoded, per slice allocated or freed, per bridge
+ * made, per call. With --json, the results are written the way Google Benchmark
+ * writes them, so its compare.py and anything else that reads that can
+ * be used on them. Only benchmarks whose name contains the --filter
+ * text are run.
+ *
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <link.h>
+#include <sys/mman.h>
+
+#include "bridgebuilder.h"
+#include "mem/codepool.h"
+#include "hook/probe.h"
+
+#define BENCH_MIN_TIME       0.5
+#define BENCH_MAX_ITERATIONS 1000000000
+
+// how big the synthetic decoder corpus is
+#define BENCH_SYNTHETIC_SIZE 65536
+
+// how many slices the pool benchmarks free and allocate again per batch
+#define BENCH_POOL_BATCH     1024
+#define BENCH_POOL_SLICE     16
+
+// how many made up functions bridges are made for, and how far apart
+#define BENCH_NUM_FUNCTIONS  4096
+#define BENCH_FUNCTION_SIZE  32
+
+// the probe benchmark's arg for calling the function without a probe
+#define BENCH_NO_PROBE       ((size_t)-1)
+
+/**
+ * benchfunc_t
+ *
+ * Runs a benchmark for (at least) the given number of items, and
+ * returns how many nanoseconds of that were spent on the items, leaving
+ * out any setup. *items receives how many items were really done.
+ */
+typedef double (*benchfunc_t)(size_t iterations, size_t arg, size_t* items);
+
+struct benchmark_t {
+	const char* name;
+	benchfunc_t func;
+	size_t arg;
+};
+
+static FILE* results;
+static bool jsonOutput = false;
+static double minTime = BENCH_MIN_TIME;
+static size_t numResults = 0;
+
+
+static double bench_now (void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+// keeps the compiler from throwing away results nobody looks at
+static void bench_use (size_t value) {
+	static volatile size_t sink;
+	sink += value;
+}
+
+
+// A mix of the kinds of instructions compilers emit: prologues and
+// epilogues, loads and stores with every addressing form, immediates of
+// every size, SSE and AVX. Repeated to fill the synthetic corpus.
+static const unsigned char syntheticCode[] = {
+	0x55,                                     // push rbp
+	0x48, 0x89, 0xE5,                         // mov rbp,rsp
+	0x41, 0x57,                               // push r15
+	0x48, 0x83, 0xEC, 0x28,                   // sub rsp,28h
+	0x48, 0x89, 0x7D, 0xF8,                   // mov [rbp-8],rdi
+	0x48, 0x8B, 0x05, 0x10, 0x20, 0x30, 0x00, // mov rax,[rip+302010h]
+	0x8B, 0x44, 0x24, 0x10,                   // mov eax,[rsp+10h]
+	0x48, 0x8D, 0x0C, 0x85, 0, 0, 0, 0,       // lea rcx,[rax*4]
+	0x48, 0xB8, 1, 2, 3, 4, 5, 6, 7, 8,       // mov rax,imm64
+	0x66, 0x81, 0xF9, 0x34, 0x12,             // cmp cx,1234h
+	0x0F, 0x84, 0x10, 0, 0, 0,                // je rel32
+	0x74, 0x05,                               // je rel8
+	0xE8, 0x00, 0x01, 0, 0,                   // call rel32
+	0x0F, 0xB6, 0x04, 0x0A,                   // movzx eax,byte [rdx+rcx]
+	0xF3, 0x0F, 0x10, 0x45, 0xF0,             // movss xmm0,[rbp-10h]
+	0x66, 0x0F, 0x3A, 0x0F, 0xC1, 0x08,       // palignr xmm0,xmm1,8
+	0xC5, 0xFC, 0x28, 0xC1,                   // vmovaps ymm0,ymm1
+	0xC4, 0xE2, 0x7D, 0x18, 0x07,             // vbroadcastss ymm0,[rdi]
+	0x64, 0x48, 0x8B, 0x04, 0x25, 0x28, 0, 0, 0, // mov rax,fs:[28h]
+	0xF0, 0x48, 0x0F, 0xB1, 0x0F,             // lock cmpxchg [rdi],rcx
+	0x0F, 0x1F, 0x44, 0x00, 0x00,             // nop dword [rax+rax]
+	0x48, 0x83, 0xC4, 0x28,                   // add rsp,28h
+	0x41, 0x5F,                               // pop r15
+	0x5D,                                     // pop rbp
+	0xC3,                                     // ret
+};
+
+static unsigned char* syntheticCorpus;
+static size_t syntheticSize;
+static size_t syntheticInsns;
+
+static void bench_build_synthetic (void) {
+	unsigned short offsets[256];
+
+	if (syntheticCorpus != NULL) {
+		return;
+	}
+
+	syntheticCorpus = (unsigned char*)malloc(BENCH_SYNTHETIC_SIZE);
+	for (syntheticSize = 0;
+	     syntheticSize + sizeof(syntheticCode) <= BENCH_SYNTHETIC_SIZE;
+	     syntheticSize += sizeof(syntheticCode)) {
+		memcpy(&syntheticCorpus[syntheticSize], syntheticCode,
+		       sizeof(syntheticCode));
+	}
+
+	syntheticInsns = x86_decode_boundaries(syntheticCode,
+	                                       sizeof(syntheticCode),
+	                                       X86_MODE_64, offsets, 256) - 1;
+	syntheticInsns *= syntheticSize / sizeof(syntheticCode);
+}
+
+// x86_decode_boundaries over the synthetic corpus, in one call per
+// 64KB (the most it will scan at once)
+static double bench_boundaries_synthetic (size_t iterations, size_t arg,
+                                          size_t* items) {
+	static unsigned short offsets[BENCH_SYNTHETIC_SIZE+1];
+	double start;
+
+	bench_build_synthetic();
+
+	start = bench_now();
+	for (*items = 0; *items < iterations; ) {
+		*items += x86_decode_boundaries(syntheticCorpus, syntheticSize,
+		                                X86_MODE_64, offsets,
+		                                BENCH_SYNTHETIC_SIZE+1) - 1;
+	}
+	return bench_now() - start;
+}
+
+// x86_instruction_length one instruction at a time, the way bridge_create
+// and everyone else used to
+static double bench_length_synthetic (size_t iterations, size_t arg,
+                                      size_t* items) {
+	double start;
+	size_t offset;
+	int length;
+
+	bench_build_synthetic();
+
+	start = bench_now();
+	for (*items = 0; *items < iterations; ) {
+		for (offset = 0; offset < syntheticSize; offset += length) {
+			length = x86_instruction_length(&syntheticCorpus[offset],
+			                                X86_MODE_64, false);
+		}
+		*items += syntheticInsns;
+	}
+	return bench_now() - start;
+}
+
+
+// the executable segments of libc, as real code to decode
+static unsigned char* libcCode[8];
+static size_t libcSize[8];
+static size_t libcSegments;
+
+static int bench_find_libc (struct dl_phdr_info* info, size_t size,
+                            void* unused) {
+	int j;
+
+	if (strstr(info->dlpi_name, "libc.so") == NULL) {
+		return 0;
+	}
+
+	for (j = 0; j < info->dlpi_phnum && libcSegments < 8; j++) {
+		if (info->dlpi_phdr[j].p_type == PT_LOAD
+		    && (info->dlpi_phdr[j].p_flags & PF_X)) {
+			libcCode[libcSegments] = (unsigned char*)(info->dlpi_addr
+			                         + info->dlpi_phdr[j].p_vaddr);
+			libcSize[libcSegments] = info->dlpi_phdr[j].p_memsz;
+			libcSegments++;
+		}
+	}
+	return 1;
+}
+
+// Sweeps straight through libc's code with x86_decode_boundaries. Data
+// and padding in there don't always decode, so on a failure it just
+// steps a byte ahead and carries on, like a linear disassembler would.
+static double bench_boundaries_libc (size_t iterations, size_t arg,
+                                     size_t* items) {
+	static unsigned short offsets[65536];
+	size_t segment, offset, length, count;
+	double start;
+
+	if (libcSegments == 0) {
+		dl_iterate_phdr(bench_find_libc, NULL);
+		if (libcSegments == 0) {
+			*items = 0;
+			return 0;
+		}
+	}
+
+	start = bench_now();
+	for (*items = 0; *items < iterations; ) {
+		for (segment = 0; segment < libcSegments; segment++) {
+			for (offset = 0; offset < libcSize[segment]; ) {
+				length = libcSize[segment] - offset;
+				if (length > 65535) {
+					length = 65535;
+				}
+				count = x86_decode_boundaries(&libcCode[segment][offset],
+				                              length, X86_MODE_NATIVE,
+				                              offsets, 65536);
+				*items += count - 1;
+				offset += offsets[count-1];
+
+				// stopped on something it couldn't decode, rather than
+				// just the end of what it was given. (Or couldn't decode
+				// anything at all, which near the end of a segment can
+				// look like running out of bytes, and would otherwise
+				// never get any further.)
+				if (   offsets[count-1] == 0
+				    || (   (size_t)offsets[count-1]
+				           + X86_MAX_INSTRUCTION_LENGTH <= length
+				        && count < 65536)) {
+					offset++;
+				}
+			}
+		}
+	}
+	return bench_now() - start;
+}
+
+
+// Slices held by the pool benchmarks, kept between them so the pool only
+// ever has to be filled up to the next size.
+static void** poolSlices;
+static size_t numPoolSlices;
+
+// fills the pool up to the given number of pages' worth of slices
+static bool bench_fill_pool (size_t pages) {
+	size_t wanted = pages * (getpagesize() / BENCH_POOL_SLICE);
+
+	if (numPoolSlices >= wanted) {
+		return true;
+	}
+
+	poolSlices = (void**)realloc(poolSlices, sizeof(void*) * wanted);
+	for (; numPoolSlices < wanted; numPoolSlices++) {
+		poolSlices[numPoolSlices] = codepool_alloc(BENCH_POOL_SLICE, NULL,
+		                                           NULL);
+		if (poolSlices[numPoolSlices] == NULL) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Frees a batch of slices spread out over the whole pool, timing either
+// the frees or allocating them all again. Spread out, so each one is on
+// a different page and the freeing has to find it.
+static double bench_pool (size_t iterations, size_t pages, size_t* items,
+                          bool timeFree) {
+	size_t batch, stride, j;
+	double start, elapsed = 0;
+
+	if (bench_fill_pool(pages) == false) {
+		*items = 0;
+		return 0;
+	}
+	batch = BENCH_POOL_BATCH;
+	if (batch > numPoolSlices) {
+		batch = numPoolSlices;
+	}
+	stride = numPoolSlices / batch;
+
+	for (*items = 0; *items < iterations; *items += batch) {
+		start = bench_now();
+		for (j = 0; j < batch; j++) {
+			codepool_free(poolSlices[j*stride]);
+		}
+		if (timeFree) {
+			elapsed += bench_now() - start;
+		}
+
+		// the thread's cache would hand the last few straight back
+		codepool_flush_cache();
+
+		start = bench_now();
+		for (j = 0; j < batch; j++) {
+			poolSlices[j*stride] = codepool_alloc(BENCH_POOL_SLICE, NULL,
+			                                      NULL);
+		}
+		if (timeFree == false) {
+			elapsed += bench_now() - start;
+		}
+	}
+	return elapsed;
+}
+
+static double bench_pool_alloc (size_t iterations, size_t pages,
+                                size_t* items) {
+	return bench_pool(iterations, pages, items, false);
+}
+
+static double bench_pool_free (size_t iterations, size_t pages,
+                               size_t* items) {
+	return bench_pool(iterations, pages, items, true);
+}
+
+
+// Made up functions to make bridges for, every one at a different
+// address so none of them already has a bridge. Each starts with one of
+// a few prologues, some of which need their instructions relocated.
+static unsigned char* functions;
+
+static const unsigned char prologues[][16] = {
+	// push rbp; mov rbp,rsp; sub rsp,20h
+	{ 0x55, 0x48, 0x89, 0xE5, 0x48, 0x83, 0xEC, 0x20 },
+	// sub rsp,28h; mov rax,[rip+1000h]
+	{ 0x48, 0x83, 0xEC, 0x28, 0x48, 0x8B, 0x05, 0x00, 0x10, 0, 0 },
+	// test rdi,rdi; je +10h; mov eax,[rdi]
+	{ 0x48, 0x85, 0xFF, 0x74, 0x10, 0x8B, 0x07 },
+	// push rbx; push r12; call rel32
+	{ 0x53, 0x41, 0x54, 0xE8, 0x00, 0x20, 0, 0 },
+};
+
+static void bench_build_functions (void) {
+	size_t j;
+
+	if (functions != NULL) {
+		return;
+	}
+
+	functions = (unsigned char*)mmap(NULL,
+	                                 BENCH_NUM_FUNCTIONS*BENCH_FUNCTION_SIZE,
+	                                 PROT_READ | PROT_WRITE,
+	                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	memset(functions, 0xCC, BENCH_NUM_FUNCTIONS*BENCH_FUNCTION_SIZE);
+	for (j = 0; j < BENCH_NUM_FUNCTIONS; j++) {
+		memcpy(&functions[j*BENCH_FUNCTION_SIZE],
+		       prologues[j % (sizeof(prologues)/sizeof(prologues[0]))],
+		       sizeof(prologues[0]));
+	}
+	mprotect(functions, BENCH_NUM_FUNCTIONS*BENCH_FUNCTION_SIZE,
+	         PROT_READ | PROT_EXEC);
+}
+
+// bridge_create and bridge_destroy for every function, with the plan
+// cache on (arg 1) or off (arg 0). Each pass makes all the bridges
+// before destroying any, so they don't just keep reusing one slot.
+static double bench_bridge (size_t iterations, size_t cached,
+                            size_t* items) {
+	static void* bridges[BENCH_NUM_FUNCTIONS];
+	double start, elapsed = 0;
+	size_t j;
+
+	bench_build_functions();
+	bridge_cache_enable(cached != 0);
+
+	for (*items = 0; *items < iterations; *items += BENCH_NUM_FUNCTIONS) {
+		start = bench_now();
+		codepool_begin_write();
+		for (j = 0; j < BENCH_NUM_FUNCTIONS; j++) {
+			bridges[j] = bridge_create(&functions[j*BENCH_FUNCTION_SIZE]);
+		}
+		for (j = 0; j < BENCH_NUM_FUNCTIONS; j++) {
+			bridge_destroy(bridges[j]);
+		}
+		codepool_commit();
+		elapsed += bench_now() - start;
+	}
+
+	bridge_cache_enable(false);
+	return elapsed;
+}
+
+// bridge_create for functions that already have a bridge, which only
+// has to find it
+static double bench_bridge_shared (size_t iterations, size_t arg,
+                                   size_t* items) {
+	static void* bridges[BENCH_NUM_FUNCTIONS];
+	double start, elapsed;
+	size_t j;
+
+	bench_build_functions();
+	for (j = 0; j < BENCH_NUM_FUNCTIONS; j++) {
+		bridges[j] = bridge_create(&functions[j*BENCH_FUNCTION_SIZE]);
+	}
+
+	start = bench_now();
+	for (*items = 0; *items < iterations; *items += BENCH_NUM_FUNCTIONS) {
+		for (j = 0; j < BENCH_NUM_FUNCTIONS; j++) {
+			bench_use((size_t)bridge_create(
+				&functions[j*BENCH_FUNCTION_SIZE]));
+		}
+		for (j = 0; j < BENCH_NUM_FUNCTIONS; j++) {
+			bridge_destroy(bridges[j]);
+		}
+	}
+	elapsed = bench_now() - start;
+
+	for (j = 0; j < BENCH_NUM_FUNCTIONS; j++) {
+		bridge_destroy(bridges[j]);
+	}
+	return elapsed;
+}
+
+// what the probe benchmarks call, with enough to it to be hooked
+static __attribute__((noinline)) size_t bench_probed (size_t value) {
+	__asm__ volatile ("" : "+r" (value));
+	return value*3 + 1;
+}
+
+// Calls a function through a probe that only counts (arg 0) or also
+// times every arg'th call, or without one for comparison.
+static double bench_probe (size_t iterations, size_t sampleEvery,
+                           size_t* items) {
+	size_t (* volatile call)(size_t) = bench_probed;
+	double start, elapsed;
+	size_t value = 0;
+
+	if (sampleEvery != BENCH_NO_PROBE
+	    && probe_install((void*)bench_probed, (unsigned int)sampleEvery)
+	       == false) {
+		*items = 0;
+		return 0;
+	}
+
+	start = bench_now();
+	for (*items = 0; *items < iterations; (*items)++) {
+		value = call(value);
+	}
+	elapsed = bench_now() - start;
+	bench_use(value);
+
+	if (sampleEvery != BENCH_NO_PROBE) {
+		probe_remove((void*)bench_probed);
+	}
+	return elapsed;
+}
+
+static const benchmark_t benchmarks[] = {
+	{ "decode_boundaries/synthetic", bench_boundaries_synthetic, 0 },
+	{ "decode_length/synthetic",     bench_length_synthetic,     0 },
+	{ "decode_boundaries/libc",      bench_boundaries_libc,      0 },
+	{ "codepool_alloc/1",            bench_pool_alloc,           1 },
+	{ "codepool_free/1",             bench_pool_free,            1 },
+	{ "codepool_alloc/10",           bench_pool_alloc,           10 },
+	{ "codepool_free/10",            bench_pool_free,            10 },
+	{ "codepool_alloc/100",          bench_pool_alloc,           100 },
+	{ "codepool_free/100",           bench_pool_free,            100 },
+	{ "codepool_alloc/1000",         bench_pool_alloc,           1000 },
+	{ "codepool_free/1000",          bench_pool_free,            1000 },
+	{ "codepool_alloc/10000",        bench_pool_alloc,           10000 },
+	{ "codepool_free/10000",         bench_pool_free,            10000 },
+	{ "bridge_create/uncached",      bench_bridge,               0 },
+	{ "bridge_create/cached",        bench_bridge,               1 },
+	{ "bridge_create/shared",        bench_bridge_shared,        0 },
+	{ "probe_call/none",             bench_probe,     BENCH_NO_PROBE },
+	{ "probe_call/count",            bench_probe,                0 },
+	{ "probe_call/sample1024",       bench_probe,                1024 },
+	{ "probe_call/sample1",          bench_probe,                1 },
+};
+
+// Runs a benchmark with ten times the iterations each time (or however
+// many more look like they'll be enough) until it runs for long enough.
+static void bench_run (const benchmark_t* benchmark) {
+	size_t iterations = 1, items = 0;
+	double elapsed = 0, perItem;
+
+	for (;;) {
+		elapsed = benchmark->func(iterations, benchmark->arg, &items);
+		if (items == 0) {
+			fprintf(stderr, "%s: couldn't be run\n", benchmark->name);
+			return;
+		}
+		if (elapsed >= minTime*1e9 || iterations >= BENCH_MAX_ITERATIONS) {
+			break;
+		}
+
+		perItem = (elapsed > 0) ? elapsed / items : 1;
+		if (items > iterations) {
+			iterations = items;
+		}
+		if (iterations * 10 < minTime*1.4e9 / perItem) {
+			iterations *= 10;
+		}
+		else {
+			iterations = (size_t)(minTime*1.4e9 / perItem) + 1;
+		}
+	}
+
+	perItem = elapsed / items;
+	if (jsonOutput) {
+		fprintf(results, "%s    {\n"
+		                 "      \"name\": \"%s\",\n"
+		                 "      \"run_type\": \"iteration\",\n"
+		                 "      \"iterations\": %zu,\n"
+		                 "      \"real_time\": %.4f,\n"
+		                 "      \"cpu_time\": %.4f,\n"
+		                 "      \"time_unit\": \"ns\",\n"
+		                 "      \"items_per_second\": %.1f\n"
+		                 "    }",
+		        (numResults > 0) ? ",\n" : "", benchmark->name, items,
+		        perItem, perItem, 1e9 / perItem);
+	}
+	else {
+		fprintf(results, "%-32s %12.2f ns %14zu %14.0f/s\n",
+		        benchmark->name, perItem, items, 1e9 / perItem);
+	}
+	fflush(results);
+	numResults++;
+}
+
+int main (int argc, char* argv[]) {
+	const char* filter = "";
+	char date[64];
+	time_t now;
+	size_t j;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--json") == 0) {
+			jsonOutput = true;
+		}
+		else if (strncmp(argv[i], "--filter=", 9) == 0) {
+			filter = &argv[i][9];
+		}
+		else if (strncmp(argv[i], "--min-time=", 11) == 0) {
+			minTime = atof(&argv[i][11]);
+		}
+		else {
+			fprintf(stderr, "usage: %s [--json] [--filter=text] "
+			                "[--min-time=seconds]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	results = stdout;
+
+	if (jsonOutput) {
+		now = time(NULL);
+		strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+		fprintf(results, "{\n"
+		                 "  \"context\": {\n"
+		                 "    \"date\": \"%s\",\n"
+		                 "    \"executable\": \"%s\",\n"
+		                 "    \"num_cpus\": %ld,\n"
+		                 "    \"library_build_type\": \"%s\"\n"
+		                 "  },\n"
+		                 "  \"benchmarks\": [\n",
+		        date, argv[0], sysconf(_SC_NPROCESSORS_ONLN),
+		        #ifdef NDEBUG
+		        	"release"
+		        #else
+		        	"debug"
+		        #endif
+		        );
+	}
+	else {
+		fprintf(results, "%-32s %15s %14s %16s\n", "Benchmark", "Time",
+		        "Iterations", "Items");
+	}
+
+	for (j = 0; j < sizeof(benchmarks)/sizeof(benchmarks[0]); j++) {
+		if (strstr(benchmarks[j].name, filter) != NULL) {
+			bench_run(&benchmarks[j]);
+		}
+	}
+
+	if (jsonOutput) {
+		fprintf(results, "\n  ]\n}\n");
+	}
+	fclose(results);
+	return 0;
+}
\ No newline at end of file
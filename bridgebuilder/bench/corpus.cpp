@@ -0,0 +1,381 @@
+/**
+ * corpus.cpp
+ *
+ * Runs the decoder and bridge_create over every function exported by
+ * every library loaded into the process (libc, libm, libstdc++, and
+ * whatever else is given on the command line), as a real-world measure
+ * of how fast and how complete they are.
+ *
+ * Linux only, since it finds the libraries with dl_iterate_phdr and
+ * their exports in their dynamic symbol tables. Build it from this
+ * directory with something like:
+ *
+ *   g++ -O2 -I.. corpus.cpp ../bridgebuilder.cpp ../mem/codepool.cpp \
+ *       -lpthread -ldl -o corpus
+ *
+ * and run it as
+ *
+ *   ./corpus [library.so ...]
+ *
+ * For every library it reports how many functions it exports, how fast
+ * their code decoded, and how many of them bridge_create could make a
+ * bridge for, and then which opcodes decoding most often failed on.
+ * Functions whose symbols don't give a size are left out, since there's
+ * no telling where they end, and are only counted.
+ *
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <elf.h>
+
+#include "bridgebuilder.h"
+#include "mem/codepool.h"
+
+// how much of a function is decoded, at most
+#define CORPUS_MAX_SIZE     65535
+// how many of the most common failing opcodes are listed
+#define CORPUS_TOP_FAILURES 20
+
+struct function_t {
+	unsigned char* address;
+	size_t size;
+};
+
+struct library_t {
+	const char* name;
+	function_t* functions;
+	size_t numFunctions;
+	size_t maxFunctions;
+	// functions left out for not having a size
+	size_t numUnsized;
+};
+
+// where decoding failed, by the X86_MAP_* map and opcode it failed on,
+// going by the decoder's own counts from before and after each library
+// (bridge_create's failures are left out, they'd count each one twice)
+static unsigned long long failures[X86_NUM_MAPS][256];
+static x86_stats_t before, after;
+
+// loaded along with the ones on the command line, so there's more than
+// libc to go on even without any
+static const char* defaultLibraries[] = {"libm.so.6", "libstdc++.so.6"};
+
+static library_t* libraries;
+static size_t numLibraries;
+
+static FILE* results;
+
+
+static double corpus_now (void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+// The dynamic section's pointers have usually been relocated already,
+// but not always (the vDSO's, for one).
+static size_t corpus_dyn_address (struct dl_phdr_info* info, size_t ptr) {
+	if (ptr < info->dlpi_addr) {
+		return info->dlpi_addr + ptr;
+	}
+	return ptr;
+}
+
+// How many symbols there are. The dynamic section doesn't say outright,
+// so it's the number of chains in DT_HASH, or, for DT_GNU_HASH, one past
+// the end of the last chain.
+static size_t corpus_count_symbols (const Elf32_Word* hash,
+                                    const Elf32_Word* gnuHash) {
+	const Elf32_Word *buckets, *chains;
+	Elf32_Word numBuckets, symbolBase, bloomSize, last = 0;
+	size_t j;
+
+	if (hash != NULL) {
+		return hash[1];
+	}
+	if (gnuHash == NULL) {
+		return 0;
+	}
+
+	numBuckets = gnuHash[0];
+	symbolBase = gnuHash[1];
+	bloomSize = gnuHash[2];
+	buckets = &gnuHash[4 + bloomSize * (sizeof(ElfW(Addr)) / 4)];
+	chains = &buckets[numBuckets];
+
+	for (j = 0; j < numBuckets; j++) {
+		if (buckets[j] > last) {
+			last = buckets[j];
+		}
+	}
+	if (last < symbolBase) {
+		return symbolBase;
+	}
+	// the last entry of a chain has its low bit set
+	while ((chains[last - symbolBase] & 1) == 0) {
+		last++;
+	}
+	return last + 1;
+}
+
+static void corpus_add_function (library_t* library, unsigned char* address,
+                                 size_t size) {
+	if (library->numFunctions == library->maxFunctions) {
+		library->maxFunctions = library->maxFunctions * 2 + 64;
+		library->functions = (function_t*)realloc(library->functions,
+		                     sizeof(function_t) * library->maxFunctions);
+	}
+	library->functions[library->numFunctions].address = address;
+	library->functions[library->numFunctions].size = size;
+	library->numFunctions++;
+}
+
+static int corpus_compare_functions (const void* a, const void* b) {
+	const function_t* fa = (const function_t*)a;
+	const function_t* fb = (const function_t*)b;
+
+	if (fa->address != fb->address) {
+		return (fa->address < fb->address) ? -1 : 1;
+	}
+	// the one with a size first, so it's the one that's kept
+	return (fa->size > fb->size) ? -1 : (fa->size < fb->size);
+}
+
+// Collects the defined functions in a library's dynamic symbol table.
+static int corpus_find_library (struct dl_phdr_info* info, size_t size,
+                                void* unused) {
+	const ElfW(Dyn)* dynamic = NULL;
+	const ElfW(Sym)* symbols = NULL;
+	const Elf32_Word *hash = NULL, *gnuHash = NULL;
+	library_t* library;
+	unsigned char* last = NULL;
+	size_t numSymbols, j, kept;
+	int type;
+
+	for (j = 0; j < info->dlpi_phnum; j++) {
+		if (info->dlpi_phdr[j].p_type == PT_DYNAMIC) {
+			dynamic = (const ElfW(Dyn)*)(info->dlpi_addr
+			                             + info->dlpi_phdr[j].p_vaddr);
+		}
+	}
+	if (dynamic == NULL) {
+		return 0;
+	}
+
+	for (; dynamic->d_tag != DT_NULL; dynamic++) {
+		switch (dynamic->d_tag) {
+			case DT_SYMTAB:
+				symbols = (const ElfW(Sym)*)corpus_dyn_address(info,
+				          dynamic->d_un.d_ptr);
+				break;
+			case DT_HASH:
+				hash = (const Elf32_Word*)corpus_dyn_address(info,
+				       dynamic->d_un.d_ptr);
+				break;
+			case DT_GNU_HASH:
+				gnuHash = (const Elf32_Word*)corpus_dyn_address(info,
+				          dynamic->d_un.d_ptr);
+				break;
+		}
+	}
+	numSymbols = corpus_count_symbols(hash, gnuHash);
+	if (symbols == NULL || numSymbols == 0) {
+		return 0;
+	}
+
+	libraries = (library_t*)realloc(libraries,
+	                                sizeof(library_t) * (numLibraries+1));
+	library = &libraries[numLibraries++];
+	library->name = (info->dlpi_name[0] != 0) ? strdup(info->dlpi_name)
+	                                          : "(main program)";
+	library->functions = NULL;
+	library->numFunctions = library->maxFunctions = 0;
+	library->numUnsized = 0;
+
+	for (j = 0; j < numSymbols; j++) {
+		type = ELF64_ST_TYPE(symbols[j].st_info);
+		if ((type == STT_FUNC || type == STT_GNU_IFUNC)
+		    && symbols[j].st_shndx != SHN_UNDEF
+		    && symbols[j].st_value != 0) {
+			corpus_add_function(library, (unsigned char*)(info->dlpi_addr
+			                    + symbols[j].st_value), symbols[j].st_size);
+		}
+	}
+
+	// aliases would otherwise be counted (and get bridges) twice. A
+	// function without a size could end anywhere, decoding a guess at
+	// it would run into the next one or off the end of the segment, so
+	// those are only counted.
+	qsort(library->functions, library->numFunctions, sizeof(function_t),
+	      corpus_compare_functions);
+	for (j = kept = 0; j < library->numFunctions; j++) {
+		if (library->functions[j].address == last) {
+			continue;
+		}
+		last = library->functions[j].address;
+		if (library->functions[j].size == 0) {
+			library->numUnsized++;
+			continue;
+		}
+		library->functions[kept++] = library->functions[j];
+	}
+	library->numFunctions = kept;
+
+	return 0;
+}
+
+static void corpus_print_opcode (int map, unsigned char opcode) {
+	if (map >= X86_MAP_VEX) {
+		fprintf(results, "%02X map %d", opcode, map - X86_MAP_VEX);
+	} else if (map == X86_MAP_0F) {
+		fprintf(results, "0F %02X", opcode);
+	} else {
+		fprintf(results, "%02X", opcode);
+	}
+}
+
+int main (int argc, char* argv[]) {
+	size_t totalFunctions = 0, totalDecoded = 0, totalBridged = 0;
+	size_t totalInsns = 0, totalBytes = 0, insns, bytes, decoded, bridged;
+	size_t totalUnsized = 0;
+	size_t length, offset, j, k;
+	unsigned int worst[CORPUS_TOP_FAILURES];
+	unsigned long long* counts = &failures[0][0];
+	codepool_stats_t poolStats;
+	double start, elapsed, totalElapsed = 0, bridgeElapsed = 0;
+	library_t* library;
+	void* bridge;
+	int i, map, opcode, result;
+
+	for (j = 0; j < sizeof(defaultLibraries) / sizeof(defaultLibraries[0]);
+	     j++) {
+		if (dlopen(defaultLibraries[j], RTLD_NOW) == NULL) {
+			fprintf(stderr, "%s\n", dlerror());
+			return 1;
+		}
+	}
+	for (i = 1; i < argc; i++) {
+		if (dlopen(argv[i], RTLD_NOW) == NULL) {
+			fprintf(stderr, "%s\n", dlerror());
+			return 1;
+		}
+	}
+
+	results = stdout;
+
+	dl_iterate_phdr(corpus_find_library, NULL);
+
+	fprintf(results, "%-40s %9s %9s %10s %9s %9s\n", "library", "functions",
+	       "decoded", "ns/insn", "bridged", "unsized");
+
+	for (j = 0; j < numLibraries; j++) {
+		library = &libraries[j];
+		totalUnsized += library->numUnsized;
+		if (library->numFunctions == 0) {
+			continue;
+		}
+		insns = bytes = decoded = bridged = 0;
+
+		// Decode every function from start to end, one instruction at
+		// a time, the way bridge_create does its first few.
+		x86_get_stats(&before);
+		start = corpus_now();
+		for (k = 0; k < library->numFunctions; k++) {
+			length = library->functions[k].size;
+			if (length > CORPUS_MAX_SIZE) {
+				length = CORPUS_MAX_SIZE;
+			}
+			for (offset = 0; offset < length; offset += result) {
+				result = x86_instruction_length(
+				         &library->functions[k].address[offset],
+				         X86_MODE_NATIVE, false);
+				if (result < 0) {
+					break;
+				}
+				insns++;
+			}
+			bytes += offset;
+			if (offset >= length) {
+				decoded++;
+			}
+		}
+		elapsed = corpus_now() - start;
+		x86_get_stats(&after);
+		for (map = 0; map < X86_NUM_MAPS; map++) {
+			for (opcode = 0; opcode < 256; opcode++) {
+				failures[map][opcode] += after.failuresByOpcode[map][opcode]
+				                         - before.failuresByOpcode[map][opcode];
+			}
+		}
+
+		start = corpus_now();
+		for (k = 0; k < library->numFunctions; k++) {
+			bridge = bridge_create(library->functions[k].address);
+			if (bridge != NULL) {
+				bridge_destroy(bridge);
+				bridged++;
+			}
+		}
+		bridgeElapsed += corpus_now() - start;
+		fprintf(results, "%-40.40s %9zu %8.1f%% %10.2f %8.1f%% %9zu\n",
+		       library->name, library->numFunctions,
+		       100.0 * decoded / library->numFunctions,
+		       (insns > 0) ? elapsed / insns : 0.0,
+		       100.0 * bridged / library->numFunctions, library->numUnsized);
+
+		totalFunctions += library->numFunctions;
+		totalDecoded += decoded;
+		totalBridged += bridged;
+		totalInsns += insns;
+		totalBytes += bytes;
+		totalElapsed += elapsed;
+	}
+
+	if (totalFunctions == 0) {
+		fprintf(results, "no exported functions found\n");
+		return 1;
+	}
+	fprintf(results, "%-40s %9zu %8.1f%% %10.2f %8.1f%% %9zu\n", "total",
+	       totalFunctions, 100.0 * totalDecoded / totalFunctions,
+	       (totalInsns > 0) ? totalElapsed / totalInsns : 0.0,
+	       100.0 * totalBridged / totalFunctions, totalUnsized);
+	fprintf(results, "\n%zu instructions, %zu bytes, %.1f MB/s\n", totalInsns,
+	       totalBytes, totalBytes / (totalElapsed / 1e9) / 1e6);
+	fprintf(results, "%.1f ns per bridge_create\n",
+	        bridgeElapsed / totalFunctions);
+
+	// what all those bridges took out of the code pool
+	codepool_get_stats(&poolStats);
+	fprintf(results, "%zu code pages, %llu protection changes, "
+	        "%.1f%% free\n", poolStats.pages, poolStats.protectionChanges,
+	        100.0 * poolStats.fragmentation);
+
+	// the most common opcodes decoding stopped on
+	memset(worst, 0, sizeof(worst));
+	for (j = 0; j < X86_NUM_MAPS * 256; j++) {
+		for (k = 0; k < CORPUS_TOP_FAILURES; k++) {
+			if (counts[j] > counts[worst[k]]) {
+				memmove(&worst[k+1], &worst[k],
+				        sizeof(worst[0]) * (CORPUS_TOP_FAILURES-k-1));
+				worst[k] = (unsigned int)j;
+				break;
+			}
+		}
+	}
+	if (counts[worst[0]] > 0) {
+		fprintf(results, "\nfailures by opcode:\n");
+	}
+	for (k = 0; k < CORPUS_TOP_FAILURES && counts[worst[k]] > 0; k++) {
+		fprintf(results, "  ");
+		corpus_print_opcode(worst[k] / 256, worst[k] % 256);
+		fprintf(results, "\t%llu\n", counts[worst[k]]);
+	}
+
+	return 0;
+}
\ No newline at end of file
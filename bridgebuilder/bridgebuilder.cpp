@@ -1,21 +1,877 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "bridgebuilder.h"
 #include "mem/codepool.h"
+#ifdef _WIN32
+ #define WIN32_LEAN_AND_MEAN
+ #include <Windows.h>
+#else
+ #include <pthread.h>
+#endif
 
-void* bridge_create (void* unhookedFunction) {
+// The number of bytes at the start of a hooked function that get
+// overwritten by the hook's JMP rel32, and so have to be moved into the
+// bridge.
+#define BRIDGE_HOOK_SIZE 5
+
+// Upper bound on the size of a bridge: at most BRIDGE_HOOK_SIZE
+// instructions get moved, and the largest thing any of them turns into
+// is a LOOP/JCXZ through an absolute jump or a load through the literal
+// pool (19 bytes with prefixes and literal), plus the absolute jump back
+// into the function at the end.
+#define BRIDGE_MAX_SIZE 128
+
+// The most bytes the moved instructions can take up: the last one starts
+// inside the hook's JMP and can be as long as any instruction.
+#define BRIDGE_MAX_MOVED (BRIDGE_HOOK_SIZE + X86_MAX_INSTRUCTION_LENGTH - 1)
+
+// Decoded prologues, for making bridges for the same functions over and
+// over without decoding them every time (see bridge_cache_enable). An
+// open-addressed hash table keyed by function address, which only ever
+// grows, it's emptied by turning the cache off. Bridges destroyed while
+// it's on are kept in their plan rather than freed, so making the same
+// bridge again is just handing it back.
+struct bridgeplan_t {
+	// NULL for an empty slot
+	const unsigned char* function;
+	// the moved bytes as they were when they were decoded. The plan is
+	// only good for as long as the function still starts with them.
+	unsigned char code[BRIDGE_MAX_MOVED];
+	unsigned char numBytes;
+	unsigned char numInsns;
+	x86_instruction_t insns[BRIDGE_HOOK_SIZE];
+	// how big the bridge is when it's near enough to the function
+	unsigned char nearSize;
+	// the last bridge made from this plan, once it's been destroyed, or
+	// NULL. It was made for this function from these bytes, so it's as
+	// good as a new one for as long as they're the same.
+	void* bridge;
+};
+
+// the smallest the hash tables get
+#define BRIDGE_TABLE_MIN_SIZE 64
+
+static bridgeplan_t* planCache = NULL;
+static size_t planCacheSize = 0;
+static size_t planCacheUsed = 0;
+static bool volatile planCacheEnabled = false;
+
+// Every bridge there is, so a second bridge_create for the same function
+// gets the same bridge back instead of another copy (which, if the
+// function had been hooked by then, would have been made from the hook
+// instead of the function). It's indexed both ways, by function for
+// bridge_create and by bridge for bridge_destroy, in open-addressed hash
+// tables.
+struct bridgeentry_t {
+	// NULL for an empty slot
+	void* key;
+	void* value;
+	// how many bridge_creates the bridge is still out for (only kept by
+	// function)
+	size_t refs;
+};
+
+struct bridgetable_t {
+	bridgeentry_t* entries;
+	size_t size;
+	size_t used;
+};
+
+static bridgetable_t bridgesByFunction = { NULL, 0, 0 };
+static bridgetable_t bridgesByBridge = { NULL, 0, 0 };
+
+#ifdef _WIN32
+ static SRWLOCK planCacheLock = SRWLOCK_INIT;
+ static SRWLOCK registryLock = SRWLOCK_INIT;
+#else
+ static pthread_mutex_t planCacheLock = PTHREAD_MUTEX_INITIALIZER;
+ static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// Statistics for x86_get_stats. Bumped with relaxed atomic adds, decoding
+// happens on any number of threads at once and doesn't take any locks.
+static x86_stats_t volatile decoderStats;
+static x86_failure_hook_t volatile failureHook = NULL;
+
+#ifdef _WIN32
+ #define X86_STAT_ADD(counter, n) \
+	InterlockedExchangeAdd64((LONGLONG volatile*)&(counter), (LONGLONG)(n))
+#else
+ #define X86_STAT_ADD(counter, n) \
+	__atomic_fetch_add(&(counter), (unsigned long long)(n), __ATOMIC_RELAXED)
+#endif
+
+#ifdef _WIN32
+ #define X86_THREAD __declspec(thread)
+#else
+ #define X86_THREAD __thread
+#endif
+
+// A locked add for every instruction shows up in x86_instruction_length's
+// time, so each thread counts its decodes on its own and only adds them
+// to the total every X86_STATS_BATCH. (So the total can be that many
+// behind per thread, and a thread exiting takes what it hadn't added
+// yet with it.)
+#define X86_STATS_BATCH 256
+
+static X86_THREAD unsigned int pendingDecodes = 0;
+
+static __inline void x86_count_decodes (size_t count) {
+	pendingDecodes += (unsigned int)count;
+	if (pendingDecodes >= X86_STATS_BATCH) {
+		X86_STAT_ADD(decoderStats.decodes, pendingDecodes);
+		pendingDecodes = 0;
+	}
+}
+
+// reads a counter in one piece, even in 32-bit code
+static __inline unsigned long long x86_stat_read (
+                                  unsigned long long volatile* counter) {
 	#ifdef _WIN32
-		static const unsigned char msPrologueSignature[] = { 0x8B,0xFF,0x55,0x8B,0xEC,0x5D };
+		return (unsigned long long)InterlockedCompareExchange64(
+		                                 (LONGLONG volatile*)counter, 0, 0);
+	#else
+		return __atomic_load_n(counter, __ATOMIC_RELAXED);
+	#endif
+}
+
+// Counts an opcode the decoder gave up on, and lets the failure hook know.
+// Only ever reached off the decoder's hot path.
+static void x86_decode_failed (const unsigned char* instruction, int map,
+                               unsigned char opcode) {
+	x86_failure_hook_t hook = failureHook;
+
+	X86_STAT_ADD(decoderStats.failures, 1);
+	X86_STAT_ADD(decoderStats.failuresByOpcode[map][opcode], 1);
+
+	if (hook) {
+		hook(instruction, map, opcode);
+	}
+}
+
+void x86_get_stats (x86_stats_t* stats) {
+	int map, opcode;
+
+	stats->decodes = x86_stat_read(&decoderStats.decodes);
+	stats->failures = x86_stat_read(&decoderStats.failures);
+	for (map = 0; map < X86_NUM_MAPS; map++) {
+		for (opcode = 0; opcode < 256; opcode++) {
+			stats->failuresByOpcode[map][opcode] =
+				x86_stat_read(&decoderStats.failuresByOpcode[map][opcode]);
+		}
+	}
+	stats->moved = x86_stat_read(&decoderStats.moved);
+	stats->relocations = x86_stat_read(&decoderStats.relocations);
+}
+
+void x86_set_failure_hook (x86_failure_hook_t hook) {
+	failureHook = hook;
+}
+
+void x86_log_failure (const void* instruction, int map,
+                      unsigned char opcode) {
+	if (map >= X86_MAP_VEX) {
+		fprintf(stderr, "Opcode %02X map %d @ %p = ???\n", opcode,
+		        map - X86_MAP_VEX, instruction);
+	} else if (map == X86_MAP_0F) {
+		fprintf(stderr, "Opcode 0F %02X @ %p = ???\n", opcode, instruction);
+	} else {
+		fprintf(stderr, "Opcode %02X @ %p = ???\n", opcode, instruction);
+	}
+}
+
+// Is target reachable with a rel32 from an instruction ending at from?
+// Always true in 32-bit mode, where the displacement wraps around.
+static __inline bool bridge_in_reach (size_t from, size_t target) {
+	#if X86_MODE_NATIVE == X86_MODE_64
+		long long distance = (long long)(target - from);
+		return distance == (long long)(int)distance;
+	#else
+		return true;
+	#endif
+}
+
+// Writes a rel32 at out that goes from an instruction ending at from
+// to target.
+static __inline void bridge_write_rel32 (unsigned char* out, size_t from,
+                                         size_t target) {
+	*(int*)out = (int)(target - from);
+}
+
+// Writes an absolute JMP (64-bit only): JMP [RIP+0] followed by the
+// address to jump to, 14 bytes in all.
+static __inline void bridge_write_abs_jmp (unsigned char* out,
+                                           size_t target) {
+	static const unsigned char jmpAbs[] = { 0xFF, 0x25, 0, 0, 0, 0 };
+
+	memcpy(out, jmpAbs, sizeof(jmpAbs));
+	memcpy(&out[sizeof(jmpAbs)], &target, sizeof(target));
+}
+
+// Where the relative branch insn at in goes to.
+static size_t bridge_branch_target (const unsigned char* in,
+                                    const x86_instruction_t* insn) {
+	// relative to the end of the instruction
+	size_t target = size_t(in) + insn->length;
+
+	switch (insn->immSize) {
+		case 1:
+			return target + (signed char)in[insn->immOffset];
+		case 2:
+			return target + *(short*)&in[insn->immOffset];
+		default:
+			return target + *(int*)&in[insn->immOffset];
+	}
+}
+
+/**
+ * Writes the far form of a RIP-relative instruction, one whose operand
+ * is out of rel32 reach from the bridge. Its address goes in the
+ * bridge's literal pool, and *litFixup is set to where in out the
+ * disp32 pointing at the literal is, which the caller fills in once it
+ * knows where the pool is.
+ *
+ * Only loads we can do without a scratch register are handled:
+ *   LEA r, [RIP+x]  ->  MOV r, [RIP+literal]
+ *   MOV r, [RIP+x]  ->  MOV r64, [RIP+literal]; MOV r, [r]
+ *
+ * @return the number of bytes written, or -1 if the instruction isn't
+ *         one of those.
+ */
+static int bridge_encode_rip_far (unsigned char* out, const unsigned char* in,
+                                  const x86_instruction_t* insn,
+                                  int* litFixup) {
+	unsigned char rex = 0, reg, op;
+	int size = 0;
+
+	// the only prefix we can cope with is REX
+	if (insn->opcodeOffset > 1) {
+		return -1;
+	}
+	if (insn->opcodeOffset == 1) {
+		rex = in[0];
+		if ((rex & 0xF0) != 0x40) {
+			return -1;
+		}
+	}
+
+	op = in[insn->opcodeOffset];
+	if (op != 0x8D && op != 0x8B) {
+		return -1;
+	}
+
+	// load the literal into the destination register: keep REX.W
+	// (a 32-bit LEA wants the low half of the address) and REX.R
+	// (which register). For MOV we need the whole address, the real
+	// operand size comes in the second instruction.
+	reg = (in[insn->opcodeOffset+1] >> 3) & 7;
+	if (op == 0x8B) {
+		out[size++] = 0x48 | (rex & 4);
+	} else if (rex & 0x0C) {
+		out[size++] = 0x40 | (rex & 0x0C);
+	}
+	out[size++] = 0x8B;
+	out[size++] = (reg << 3) | 5;
+	*litFixup = size;
+	memset(&out[size], 0, 4);
+	size += 4;
+
+	if (op == 0x8B) {
+		// MOV r, [r], with REX.B copied from REX.R so the base is
+		// the same register. [RSP]/[R12] need a SIB, and [RBP]/[R13]
+		// a disp8, since their plain encodings mean something else.
+		if (rex & 0x0C) {
+			out[size++] = 0x40 | (rex & 0x0C) | ((rex & 4) >> 2);
+		}
+		out[size++] = 0x8B;
+		if (reg == 4) {
+			out[size++] = (reg << 3) | 4;
+			out[size++] = 0x24;
+		} else if (reg == 5) {
+			out[size++] = 0x40 | (reg << 3) | 5;
+			out[size++] = 0;
+		} else {
+			out[size++] = (reg << 3) | reg;
+		}
+	}
+
+	return size;
+}
+
+/**
+ * Encodes the bridge for the numInsns instructions starting at function,
+ * to be placed at bridge, into out, and returns how big it is. Relative
+ * branches are re-encoded to reach their original targets from the
+ * bridge, using a rel32 where possible, and an absolute jump where not.
+ * RIP-relative operands are rebased the same way, falling back to
+ * loading the operand's address from a literal pool placed after the
+ * bridge's code.
+ *
+ * out may be NULL, to just find the size. bridge may be NULL when its
+ * address isn't known yet, in which case every target is assumed to be
+ * reachable with a rel32, unless forceFar is set, in which case none
+ * are (giving the worst-case size).
+ *
+ * Returns -1 if a RIP-relative operand is out of reach and the
+ * instruction can't be rewritten to use the literal pool.
+ */
+static int bridge_encode (unsigned char* out, unsigned char* bridge,
+                          const unsigned char* function,
+                          const x86_instruction_t* insns, int numInsns,
+                          bool forceFar) {
+	int j, size = 0, offset = 0, prefixes, farSize;
+	int numLits = 0, litFixup[BRIDGE_HOOK_SIZE];
+	size_t target, here, litValue[BRIDGE_HOOK_SIZE];
+	bool near;
+	unsigned char op, buf[BRIDGE_MAX_SIZE];
+	const unsigned char* in;
+
+	// encode into a scratch buffer if the caller only wants the size
+	if (out == NULL) {
+		out = buf;
+	}
+
+	for (j = 0; j < numInsns; offset += insns[j].length, j++) {
+		in = &function[offset];
+
+		if (insns[j].flags & X86_INSN_RIP_RELATIVE) {
+			// RIP is the end of the instruction, wherever the
+			// displacement is in it.
+			target = size_t(in) + insns[j].length
+			         + *(int*)&in[insns[j].dispOffset];
+			here = size_t(bridge) + size + insns[j].length;
+
+			if (forceFar || (bridge != NULL && !bridge_in_reach(here, target))) {
+				farSize = bridge_encode_rip_far(&out[size], in, &insns[j],
+				                                &litFixup[numLits]);
+				if (farSize != -1) {
+					litFixup[numLits] += size;
+					litValue[numLits++] = target;
+					size += farSize;
+					continue;
+				}
+				// can't be done, but the worst-case size is
+				// still the size of a plain copy
+				if (!forceFar) {
+					return -1;
+				}
+			}
+
+			// close enough to just fix up the displacement
+			memcpy(&out[size], in, insns[j].length);
+			bridge_write_rel32(&out[size+insns[j].dispOffset], here, target);
+			size += insns[j].length;
+			continue;
+		}
+
+		if (!(insns[j].flags & X86_INSN_RELATIVE)) {
+			// we don't have to rebase anything, so we can do a
+			// naive copy.
+			memcpy(&out[size], in, insns[j].length);
+			size += insns[j].length;
+			continue;
+		}
+
+		target = bridge_branch_target(in, &insns[j]);
+
+		// Keep any prefixes except 66, which would shrink our rel32s
+		// to rel16s. 67 matters to LOOP and JCXZ, the rest are branch
+		// hints and the like.
+		for (prefixes = 0; prefixes < insns[j].opcodeOffset; prefixes++) {
+			if (in[prefixes] != 0x66) {
+				out[size++] = in[prefixes];
+			}
+		}
+
+		op = in[insns[j].opcodeOffset];
+
+		// Where the rel32 form of this instruction would end: every
+		// rel32 form is 5 bytes, except near Jcc which is 6, and
+		// LOOP/JCXZ whose JMP rel32 comes after a 4 byte detour.
+		here = size_t(bridge) + size + 5;
+		if (op == 0x0F || (op & 0xF0) == 0x70) {
+			here += 1;
+		} else if ((op & 0xFC) == 0xE0) {
+			here += 4;
+		}
+
+		if (forceFar) {
+			near = (X86_MODE_NATIVE == X86_MODE_32);
+		} else {
+			near = (bridge == NULL) || bridge_in_reach(here, target);
+		}
+
+		if (op == 0xE8) {
+			// CALL rel32
+			if (near) {
+				out[size] = 0xE8;
+				bridge_write_rel32(&out[size+1], here, target);
+				size += 5;
+			} else {
+				// CALL [RIP+2]; JMP +8; dq target
+				static const unsigned char callAbs[] = {
+					0xFF, 0x15, 2, 0, 0, 0, 0xEB, 8
+				};
+				memcpy(&out[size], callAbs, sizeof(callAbs));
+				memcpy(&out[size+sizeof(callAbs)], &target, 8);
+				size += sizeof(callAbs) + 8;
+			}
+		} else if (op == 0xE9 || op == 0xEB) {
+			// JMP rel8/rel32
+			if (near) {
+				out[size] = 0xE9;
+				bridge_write_rel32(&out[size+1], here, target);
+				size += 5;
+			} else {
+				bridge_write_abs_jmp(&out[size], target);
+				size += 14;
+			}
+		} else if ((op & 0xFC) == 0xE0) {
+			// LOOPcc/JCXZ only come in rel8, so branch over a jump
+			// that does the long-distance part:
+			// LOOP +2; JMP SHORT +n; JMP target
+			out[size++] = op;
+			out[size++] = 2;
+			out[size++] = 0xEB;
+			if (near) {
+				out[size++] = 5;
+				out[size] = 0xE9;
+				bridge_write_rel32(&out[size+1], here, target);
+				size += 5;
+			} else {
+				out[size++] = 14;
+				bridge_write_abs_jmp(&out[size], target);
+				size += 14;
+			}
+		} else {
+			// Jcc rel8/rel32, the condition is the low nibble either way
+			if (op == 0x0F) {
+				op = in[insns[j].opcodeOffset+1];
+			}
+			if (near) {
+				out[size] = 0x0F;
+				out[size+1] = 0x80 | (op & 0xF);
+				bridge_write_rel32(&out[size+2], here, target);
+				size += 6;
+			} else {
+				// jump over the absolute jump on the opposite
+				// condition
+				out[size] = 0x70 | ((op & 0xF) ^ 1);
+				out[size+1] = 14;
+				bridge_write_abs_jmp(&out[size+2], target);
+				size += 16;
+			}
+		}
+	}
+
+	// and then the JMP back into the rest of the function
+	target = size_t(function) + offset;
+	here = size_t(bridge) + size + 5;
+	if (forceFar) {
+		near = (X86_MODE_NATIVE == X86_MODE_32);
+	} else {
+		near = (bridge == NULL) || bridge_in_reach(here, target);
+	}
+	if (near) {
+		out[size] = 0xE9;
+		bridge_write_rel32(&out[size+1], here, target);
+		size += 5;
+	} else {
+		bridge_write_abs_jmp(&out[size], target);
+		size += 14;
+	}
+
+	// the literal pool, out of the way after the last jump
+	for (j = 0; j < numLits; j++) {
+		memcpy(&out[size], &litValue[j], sizeof(litValue[j]));
+		*(int*)&out[litFixup[j]] = size - (litFixup[j] + 4);
+		size += sizeof(litValue[j]);
+	}
+
+	return size;
+}
+
+__inline void bridge_cache_enter (void) {
+	#ifdef _WIN32
+		AcquireSRWLockExclusive(&planCacheLock);
+	#else
+		pthread_mutex_lock(&planCacheLock);
+	#endif
+}
+
+__inline void bridge_cache_leave (void) {
+	#ifdef _WIN32
+		ReleaseSRWLockExclusive(&planCacheLock);
+	#else
+		pthread_mutex_unlock(&planCacheLock);
+	#endif
+}
+
+__inline size_t bridge_hash_pointer (const void* ptr, size_t tableSize) {
+	size_t hash = size_t(ptr);
+
+	// code addresses are usually aligned, so their low bits say very
+	// little. mix the rest down into them.
+	hash ^= hash >> 16;
+	hash *= (size_t)2654435761u;
+	hash ^= hash >> 13;
+	return hash & (tableSize-1);
+}
+
+// the slot function is in, or the empty one it would go in. must hold
+// the lock
+static bridgeplan_t* bridge_cache_slot (bridgeplan_t* table, size_t tableSize,
+                                        const unsigned char* function) {
+	size_t slot = bridge_hash_pointer(function, tableSize);
+
+	while (table[slot].function != NULL && table[slot].function != function) {
+		slot = (slot+1) & (tableSize-1);
+	}
+	return &table[slot];
+}
+
+// Looks for a plan for the function that still matches its bytes. If
+// the plan has a bridge kept from before, it's taken out and returned in
+// parked, and then the caller doesn't need to build one.
+static bool bridge_cache_find (const unsigned char* function,
+                               x86_instruction_t* insns, int* numInsns,
+                               int* instructionBytes, int* nearSize,
+                               void** parked) {
+	bridgeplan_t* plan;
+	bool found = false;
+
+	*parked = NULL;
+	if (planCacheEnabled == false) {
+		return false;
+	}
+
+	bridge_cache_enter();
+	if (planCache != NULL) {
+		plan = bridge_cache_slot(planCache, planCacheSize, function);
+		if (plan->function != NULL 
+		    && memcmp(plan->code, function, plan->numBytes) == 0) {
+			memcpy(insns, plan->insns, sizeof(x86_instruction_t) * plan->numInsns);
+			*numInsns = plan->numInsns;
+			*instructionBytes = plan->numBytes;
+			*nearSize = plan->nearSize;
+			*parked = plan->bridge;
+			plan->bridge = NULL;
+			found = true;
+		}
+	}
+	bridge_cache_leave();
+
+	return found;
+}
+
+// Remembers (or updates) the plan for a function.
+static void bridge_cache_put (const unsigned char* function,
+                              const x86_instruction_t* insns, int numInsns,
+                              int instructionBytes, int nearSize) {
+	bridgeplan_t *plan, *newCache;
+	size_t j, newSize;
+	void* stale = NULL;
+
+	if (planCacheEnabled == false) {
+		return;
+	}
+
+	bridge_cache_enter();
+
+	// keep it at most 3/4 full
+	if ((planCacheUsed+1)*4 > planCacheSize*3) {
+		newSize = (planCacheSize == 0) ? BRIDGE_TABLE_MIN_SIZE : planCacheSize*2;
+		newCache = (bridgeplan_t*)calloc(newSize, sizeof(bridgeplan_t));
+		if (newCache == NULL) {
+			bridge_cache_leave();
+			return;
+		}
+		for (j = 0; j < planCacheSize; j++) {
+			if (planCache[j].function != NULL) {
+				*bridge_cache_slot(newCache, newSize, planCache[j].function)
+					= planCache[j];
+			}
+		}
+		free(planCache);
+		planCache = newCache;
+		planCacheSize = newSize;
+	}
+
+	plan = bridge_cache_slot(planCache, planCacheSize, function);
+	if (plan->function == NULL) {
+		planCacheUsed++;
+	}
+	// the function's bytes changed since the kept bridge was made
+	stale = plan->bridge;
+	plan->bridge = NULL;
+	plan->function = function;
+	memcpy(plan->code, function, instructionBytes);
+	plan->numBytes = (unsigned char)instructionBytes;
+	plan->numInsns = (unsigned char)numInsns;
+	memcpy(plan->insns, insns, sizeof(x86_instruction_t) * numInsns);
+	plan->nearSize = (unsigned char)nearSize;
+
+	bridge_cache_leave();
+
+	codepool_free(stale);
+}
+
+// Keeps a bridge that's being destroyed in its function's plan, for the
+// next bridge_create to take back. false if there's no plan for it to go
+// in (or the cache is off), and then it should be freed as usual.
+static bool bridge_cache_park (const unsigned char* function, void* bridge) {
+	bridgeplan_t* plan;
+	bool parked = false;
+
+	if (planCacheEnabled == false) {
+		return false;
+	}
+
+	bridge_cache_enter();
+	if (planCache != NULL) {
+		plan = bridge_cache_slot(planCache, planCacheSize, function);
+		if (   plan->function != NULL && plan->bridge == NULL
+		    && memcmp(plan->code, function, plan->numBytes) == 0) {
+			plan->bridge = bridge;
+			parked = true;
+		}
+	}
+	bridge_cache_leave();
+
+	return parked;
+}
+
+void bridge_cache_enable (bool enable) {
+	size_t j;
+
+	bridge_cache_enter();
+	planCacheEnabled = enable;
+	if (enable == false) {
+		for (j = 0; j < planCacheSize; j++) {
+			if (planCache[j].function != NULL) {
+				codepool_free(planCache[j].bridge);
+			}
+		}
+		free(planCache);
+		planCache = NULL;
+		planCacheSize = 0;
+		planCacheUsed = 0;
+	}
+	bridge_cache_leave();
+}
+
+__inline void bridge_registry_enter (void) {
+	#ifdef _WIN32
+		AcquireSRWLockExclusive(&registryLock);
+	#else
+		pthread_mutex_lock(&registryLock);
+	#endif
+}
+
+__inline void bridge_registry_leave (void) {
+	#ifdef _WIN32
+		ReleaseSRWLockExclusive(&registryLock);
+	#else
+		pthread_mutex_unlock(&registryLock);
 	#endif
+}
+
+// must hold the registry lock
+static bridgeentry_t* bridge_table_find (bridgetable_t* table, void* key) {
+	size_t slot;
+
+	if (table->size == 0) {
+		return NULL;
+	}
+
+	slot = bridge_hash_pointer(key, table->size);
+	while (table->entries[slot].key != NULL) {
+		if (table->entries[slot].key == key) {
+			return &table->entries[slot];
+		}
+		slot = (slot+1) & (table->size-1);
+	}
+	return NULL;
+}
+
+// Adds key, which mustn't be in the table already. Returns false if
+// there's no memory for it. must hold the registry lock
+static bool bridge_table_add (bridgetable_t* table, void* key, void* value) {
+	bridgeentry_t* newEntries;
+	size_t j, slot, newSize;
+
+	// keep it at most 3/4 full
+	if ((table->used+1)*4 > table->size*3) {
+		newSize = (table->size == 0) ? BRIDGE_TABLE_MIN_SIZE : table->size*2;
+		newEntries = (bridgeentry_t*)calloc(newSize, sizeof(bridgeentry_t));
+		if (newEntries == NULL) {
+			return false;
+		}
+		for (j = 0; j < table->size; j++) {
+			if (table->entries[j].key == NULL) {
+				continue;
+			}
+			slot = bridge_hash_pointer(table->entries[j].key, newSize);
+			while (newEntries[slot].key != NULL) {
+				slot = (slot+1) & (newSize-1);
+			}
+			newEntries[slot] = table->entries[j];
+		}
+		free(table->entries);
+		table->entries = newEntries;
+		table->size = newSize;
+	}
+
+	slot = bridge_hash_pointer(key, table->size);
+	while (table->entries[slot].key != NULL) {
+		slot = (slot+1) & (table->size-1);
+	}
+	table->entries[slot].key = key;
+	table->entries[slot].value = value;
+	table->entries[slot].refs = 1;
+	table->used++;
+
+	return true;
+}
+
+// Takes an entry out, moving back any after it that would otherwise no
+// longer be found past the hole. must hold the registry lock
+static void bridge_table_remove (bridgetable_t* table, bridgeentry_t* entry) {
+	size_t hole, slot, home;
+
+	hole = slot = entry - table->entries;
+	for (;;) {
+		slot = (slot+1) & (table->size-1);
+		if (table->entries[slot].key == NULL) {
+			break;
+		}
+		// it can fill the hole unless it belongs (cyclically) after it
+		home = bridge_hash_pointer(table->entries[slot].key, table->size);
+		if ((slot > hole && (home <= hole || home > slot))
+		    || (slot < hole && home <= hole && home > slot)) {
+			table->entries[hole] = table->entries[slot];
+			hole = slot;
+		}
+	}
+	table->entries[hole].key = NULL;
+	table->used--;
+}
 
-	int operatorSize, instructionBytes = 0, bridgeSize = 5;
-	bool noRewrites = true;
+// Builds a new bridge for the function.
+static void* bridge_build (unsigned char* codePtr) {
+	int j, offset, numInsns = 0, instructionBytes = 0, bridgeSize;
+	int relocations = 0;
+	size_t target;
 
 	unsigned char* bridge;
+	unsigned char* bridgeWrite;
+
+	unsigned char code[BRIDGE_MAX_SIZE];
+	x86_instruction_t insns[BRIDGE_HOOK_SIZE];
+	void* parked;
+
+	// Find the instructions that the hook's JMP will overwrite, unless
+	// we've already been through this function and it hasn't changed.
+	if (bridge_cache_find(codePtr, insns, &numInsns, &instructionBytes,
+	                      &bridgeSize, &parked) == false) {
+		while (instructionBytes < BRIDGE_HOOK_SIZE) {
+			if (x86_decode_instruction(&codePtr[instructionBytes],
+			                           X86_MODE_NATIVE,
+			                           &insns[numInsns]) == -1) {
+				// we failed to make the bridge, bail out!
+				return 0;
+			}
+
+			instructionBytes += insns[numInsns].length;
+			numInsns++;
+		}
+
+		// A branch back into the middle of the bytes we are moving would
+		// land in the middle of the hook's JMP, so we can't bridge that.
+		for (j = 0, offset = 0; j < numInsns; offset += insns[j].length, j++) {
+			if (!(insns[j].flags & X86_INSN_RELATIVE)) {
+				continue;
+			}
+			target = bridge_branch_target(&codePtr[offset], &insns[j]);
+			if (   target > size_t(codePtr)
+			    && target < size_t(codePtr) + instructionBytes) {
+				return 0;
+			}
+		}
+
+		// Now that we know what we are moving, we can find out how much
+		// memory we'll need.
+		bridgeSize = bridge_encode(NULL, NULL, codePtr, insns, numInsns, false);
+		bridge_cache_put(codePtr, insns, numInsns, instructionBytes,
+		                 bridgeSize);
+	} else if (parked != NULL) {
+		// and we've even still got the bridge from last time
+		return parked;
+	}
+
+	// Use a slice of our shared memory page. We ask for one near the
+	// function, hoping every branch can still be reached with a rel32
+	// from wherever the bridge lands.
+	bridge = (unsigned char*)codepool_alloc(bridgeSize, codePtr,
+	                                        (void**)&bridgeWrite);
+
+	// Write the bridge out, re-encoding any branches for where it ended
+	// up. Still too far away for some of the rel32s (a branch to
+	// somewhere else entirely), so drop it and go for the worst case
+	// below.
+	if (bridge) {
+		j = bridge_encode(code, bridge, codePtr, insns, numInsns, false);
+		if (j == -1 || j > bridgeSize) {
+			codepool_free(bridge);
+			bridge = NULL;
+		} else {
+			bridgeSize = j;
+		}
+	}
+
+	// No memory near the function at all, make room for absolute jumps
+	// and literals instead, and then it can go anywhere.
+	if (!bridge) {
+		bridgeSize = bridge_encode(NULL, NULL, codePtr, insns, numInsns, true);
+		bridge = (unsigned char*)codepool_alloc(bridgeSize, NULL,
+		                                        (void**)&bridgeWrite);
+		if (!bridge) {
+			return 0;
+		}
+
+		bridgeSize = bridge_encode(code, bridge, codePtr, insns, numInsns,
+		                           false);
+		if (bridgeSize == -1) {
+			codepool_free(bridge);
+			return 0;
+		}
+	}
+
+	codepool_unlock(bridge);
+	memcpy(bridgeWrite, code, bridgeSize);
+	// relock the memory
+	codepool_lock(bridge);
 
-	unsigned char jmpBytes[] = { 0xE9, 0, 0, 0, 0 };
-	unsigned char* codePtr = (unsigned char*)unhookedFunction;
+	// count what got moved, and what of it had to be re-encoded
+	for (j = 0; j < numInsns; j++) {
+		if (insns[j].flags & (X86_INSN_RELATIVE | X86_INSN_RIP_RELATIVE)) {
+			relocations++;
+		}
+	}
+	X86_STAT_ADD(decoderStats.moved, numInsns);
+	X86_STAT_ADD(decoderStats.relocations, relocations);
+
+	return bridge;
+}
+
+void* bridge_create (void* unhookedFunction) {
+	#ifdef _WIN32
+		static const unsigned char msPrologueSignature[] = { 0x8B,0xFF,0x55,0x8B,0xEC,0x5D };
+	#endif
 
+	bridgeentry_t* entry;
+	void *bridge, *existing = NULL;
 
 	// Windows-specific: detect Microsoft-specific do-nothing
 	// prologue code, and simply return the address after it. This
@@ -29,284 +885,537 @@ void* bridge_create (void* unhookedFunction) {
 	}
 	#endif
 
-	// Determine how much memory we need to allocate ahead of time
-	while (instructionBytes < 5) {
-		operatorSize = x86_instruction_length(&codePtr[instructionBytes],true);
-		if (operatorSize == -1) {
-			// we failed to make the bridge, bail out!
-			return 0;
-		}
-		// we will have to relocate a jump
-		if (operatorSize == -2) {
-			noRewrites = false;
-			instructionBytes += x86_instruction_length(&codePtr[instructionBytes],false);
-			// TODO: write relative jmp/call rebase sizing
-			// functionality
-			return 0;
-		} else {
-			instructionBytes += operatorSize;
-			bridgeSize += operatorSize;
-		}
+	// somebody already has one, share it
+	bridge_registry_enter();
+	entry = bridge_table_find(&bridgesByFunction, unhookedFunction);
+	if (entry != NULL) {
+		entry->refs++;
+		existing = entry->value;
+	}
+	bridge_registry_leave();
+	if (existing != NULL) {
+		return existing;
 	}
 
-	// now that we know how much memory we'll need to consume, we can
-	// use a slice of our shared memory page and write out the hook
-	// function.
-	bridge = (unsigned char*)codepool_alloc(bridgeSize);
-	if (!bridge) {
+	// Building it doesn't need the lock, so bridges for different
+	// functions can be built at the same time.
+	bridge = bridge_build((unsigned char*)unhookedFunction);
+	if (bridge == NULL) {
 		return 0;
 	}
 
-	// calculate our JMP function, taking into consideration
-	// the possibility that our re-encoded bridge could be
-	// longer than the original prologue due to relative
-	// instruction rewriting
-	*(unsigned long*)(&jmpBytes[1]) =  (unsigned long)unhookedFunction - (unsigned long)bridge - (bridgeSize - instructionBytes) - 5;
+	bridge_registry_enter();
+
+	// ...but then another thread may have built one for the same function
+	// in the meantime. Theirs wins.
+	entry = bridge_table_find(&bridgesByFunction, unhookedFunction);
+	if (entry != NULL) {
+		entry->refs++;
+		existing = entry->value;
+	} else if (bridge_table_add(&bridgesByFunction, unhookedFunction,
+	                            bridge) == true
+	           && bridge_table_add(&bridgesByBridge, bridge,
+	                               unhookedFunction) == false) {
+		// If there's no memory to keep track of it, it still works, it
+		// just won't be shared (and bridge_destroy frees it right away).
+		bridge_table_remove(&bridgesByFunction,
+		                    bridge_table_find(&bridgesByFunction,
+		                                      unhookedFunction));
+	}
+
+	bridge_registry_leave();
 
-	if (noRewrites == true) {
-		// we don't have to rebase anything, so we can do a niave copy.
-		codepool_unlock(bridge);
-		// copy in most of the code
-		memcpy(bridge,unhookedFunction,instructionBytes);
-		// and then write the JMP
-		memcpy(&bridge[instructionBytes],jmpBytes,5);
-		// relock the memory
-		codepool_lock(bridge);
+	if (existing != NULL) {
+		codepool_free(bridge);
+		return existing;
 	}
 	return bridge;
 }
 
 void bridge_destroy (void* bridge) {
-	codepool_free(bridge);
-}
+	bridgeentry_t *byBridge, *byFunction;
+	void* function = NULL;
 
-int x86_instruction_length_mod_reg_rm (unsigned char* cPtr) {
-	// we're adding up the length a few bytes at a time,
-	// starting with the opcode and MOD-REG-R/M
-	int length = 2;
+	bridge_registry_enter();
+	byBridge = bridge_table_find(&bridgesByBridge, bridge);
+	if (byBridge != NULL) {
+		function = byBridge->value;
+		byFunction = bridge_table_find(&bridgesByFunction, function);
 
-	// MOD of the MOD-REG-R/M byte
-	switch (cPtr[1] >> 6) {
-		case 1:
-			length += 1; // 1-byte displacement
-			break;
-		case 2:
-			length += 4; // 4-byte displacement
-			break;
-		case 3:
-			return length;
+		// still in use by somebody else
+		if (--byFunction->refs > 0) {
+			bridge_registry_leave();
+			return;
+		}
+		bridge_table_remove(&bridgesByFunction, byFunction);
+		bridge_table_remove(&bridgesByBridge, byBridge);
 	}
+	bridge_registry_leave();
 
-	// displacement only addressing mode
-	if ((cPtr[1] >> 6) == 0 && (cPtr[1] & 7) == 5) {
-		length += 4;
+	// with the cache on, it's kept to be handed out again
+	if (   function != NULL
+	    && bridge_cache_park((const unsigned char*)function, bridge)) {
+		return;
 	}
+	codepool_free(bridge);
+}
 
-	// SIB with no displacement
-	else if ((cPtr[1] & 7) == 4) {
-		length++;
-		// if MOD==0 and base==0b101, then we have displacement!
-		if ((cPtr[1] >> 6) == 0 && (cPtr[2]&7) == 5) {
-			length += 4;
-		}
-	}
+// Opcode attribute flags used by the x86_opcode_table* lookup tables.
+// The low four bits describe the immediate that follows the opcode
+// (and MOD-REG-R/M, if present), the rest are independent flags.
+#define OP_IMM_NONE   0x000 // no immediate
+#define OP_IMM_8      0x001 // imm8
+#define OP_IMM_16     0x002 // imm16 (RET imm16)
+#define OP_IMM_16_8   0x003 // imm16 followed by imm8 (ENTER)
+#define OP_IMM_Z      0x004 // imm16 or imm32, depending on operand size
+#define OP_IMM_V      0x005 // imm16, imm32 or imm64 (MOV r64, imm64)
+#define OP_IMM_ADDR   0x006 // moffs, depending on address size
+#define OP_IMM_FAR    0x007 // ptr16:16 or ptr16:32 (far CALL/JMP)
+#define OP_IMM_GROUP3 0x008 // F6/F7, only TEST (REG 0/1) has an immediate
+#define OP_IMM_MASK   0x00F
+#define OP_MODRM      0x010 // has a MOD-REG-R/M byte
+#define OP_REL        0x020 // immediate is a relative branch displacement
+#define OP_PREFIX     0x040 // prefix byte (legacy or REX), not an opcode
+#define OP_ESCAPE     0x080 // opcode continues in the next byte (0F, 0F 38,
+                            // 0F 3A)
+#define OP_BAD        0x100 // not understood, decoding fails
+#define OP_VEX        0x200 // C4/C5/62, which start a VEX or EVEX prefix
+                            // (or are LES/LDS/BOUND, in 32-bit mode)
 
+// shorthand so the tables below fit 16 opcodes to a line
+#define __ OP_IMM_NONE
+#define I8 OP_IMM_8
+#define IW OP_IMM_16
+#define IE OP_IMM_16_8
+#define IZ OP_IMM_Z
+#define IV OP_IMM_V
+#define IA OP_IMM_ADDR
+#define IF OP_IMM_FAR
+#define G3 OP_IMM_GROUP3
+#define M  OP_MODRM
+#define R  OP_REL
+#define P  OP_PREFIX
+#define ES OP_ESCAPE
+#define XX OP_BAD
+#define VX OP_VEX
+#define X38 (OP_ESCAPE|OP_MODRM)          // 0F 38 xx /r
+#define X3A (OP_ESCAPE|OP_MODRM|OP_IMM_8) // 0F 3A xx /r ib
 
+// One-byte opcode map. This started life as a long chain of bitmasks
+// (e.g. (op & 0xC4) == 0 for 00-03,08-0B,...38-3B), which meant the
+// common opcodes near the end of the chain paid for a dozen failed
+// compares. Now it is one lookup, and the spreadsheet in the repo root
+// maps onto it row for row.
+static const unsigned short x86_opcode_table[256] = {
+/*        0     1     2     3     4     5     6     7     8     9     A     B     C     D     E     F  */
+/* 0 */   M,    M,    M,    M,    I8,   IZ,   __,   __,   M,    M,    M,    M,    I8,   IZ,   __,   ES,
+/* 1 */   M,    M,    M,    M,    I8,   IZ,   __,   __,   M,    M,    M,    M,    I8,   IZ,   __,   __,
+/* 2 */   M,    M,    M,    M,    I8,   IZ,   P,    __,   M,    M,    M,    M,    I8,   IZ,   P,    __,
+/* 3 */   M,    M,    M,    M,    I8,   IZ,   P,    __,   M,    M,    M,    M,    I8,   IZ,   P,    __,
+/* 4 */   __,   __,   __,   __,   __,   __,   __,   __,   __,   __,   __,   __,   __,   __,   __,   __,
+/* 5 */   __,   __,   __,   __,   __,   __,   __,   __,   __,   __,   __,   __,   __,   __,   __,   __,
+/* 6 */   __,   __,   M|VX, M,    P,    P,    P,    P,    IZ,   M|IZ, I8,   M|I8, __,   __,   __,   __,
+/* 7 */   R|I8, R|I8, R|I8, R|I8, R|I8, R|I8, R|I8, R|I8, R|I8, R|I8, R|I8, R|I8, R|I8, R|I8, R|I8, R|I8,
+/* 8 */   M|I8, M|IZ, M|I8, M|I8, M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,
+/* 9 */   __,   __,   __,   __,   __,   __,   __,   __,   __,   __,   IF,   __,   __,   __,   __,   __,
+/* A */   IA,   IA,   IA,   IA,   __,   __,   __,   __,   I8,   IZ,   __,   __,   __,   __,   __,   __,
+/* B */   I8,   I8,   I8,   I8,   I8,   I8,   I8,   I8,   IZ,   IZ,   IZ,   IZ,   IZ,   IZ,   IZ,   IZ,
+/* C */   M|I8, M|I8, IW,   __,   M|VX, M|VX, M|I8, M|IZ, IE,   __,   IW,   __,   __,   I8,   __,   __,
+/* D */   M,    M,    M,    M,    I8,   I8,   __,   __,   M,    M,    M,    M,    M,    M,    M,    M,
+/* E */   R|I8, R|I8, R|I8, R|I8, I8,   I8,   I8,   I8,   R|IZ, R|IZ, IF,   R|I8, __,   __,   __,   __,
+/* F */   P,    __,   P,    P,    __,   __,   M|G3, M|G3, __,   __,   __,   __,   __,   __,   M,    M
+};
 
-	return length;
-}
+// One-byte opcode map for 64-bit mode. 40-4F become REX prefixes, B8-BF
+// take a 64-bit immediate under REX.W, and the opcodes AMD64 dropped
+// (PUSH/POP segment, BCD adjustment, PUSHA/POPA, far CALL/JMP with an
+// immediate and friends) are invalid. 62, C4 and C5 are always EVEX/VEX.
+static const unsigned short x86_opcode_table_64[256] = {
+/*        0     1     2     3     4     5     6     7     8     9     A     B     C     D     E     F  */
+/* 0 */   M,    M,    M,    M,    I8,   IZ,   XX,   XX,   M,    M,    M,    M,    I8,   IZ,   XX,   ES,
+/* 1 */   M,    M,    M,    M,    I8,   IZ,   XX,   XX,   M,    M,    M,    M,    I8,   IZ,   XX,   XX,
+/* 2 */   M,    M,    M,    M,    I8,   IZ,   P,    XX,   M,    M,    M,    M,    I8,   IZ,   P,    XX,
+/* 3 */   M,    M,    M,    M,    I8,   IZ,   P,    XX,   M,    M,    M,    M,    I8,   IZ,   P,    XX,
+/* 4 */   P,    P,    P,    P,    P,    P,    P,    P,    P,    P,    P,    P,    P,    P,    P,    P,
+/* 5 */   __,   __,   __,   __,   __,   __,   __,   __,   __,   __,   __,   __,   __,   __,   __,   __,
+/* 6 */   XX,   XX,   VX,   M,    P,    P,    P,    P,    IZ,   M|IZ, I8,   M|I8, __,   __,   __,   __,
+/* 7 */   R|I8, R|I8, R|I8, R|I8, R|I8, R|I8, R|I8, R|I8, R|I8, R|I8, R|I8, R|I8, R|I8, R|I8, R|I8, R|I8,
+/* 8 */   M|I8, M|IZ, XX,   M|I8, M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,
+/* 9 */   __,   __,   __,   __,   __,   __,   __,   __,   __,   __,   XX,   __,   __,   __,   __,   __,
+/* A */   IA,   IA,   IA,   IA,   __,   __,   __,   __,   I8,   IZ,   __,   __,   __,   __,   __,   __,
+/* B */   I8,   I8,   I8,   I8,   I8,   I8,   I8,   I8,   IV,   IV,   IV,   IV,   IV,   IV,   IV,   IV,
+/* C */   M|I8, M|I8, IW,   __,   VX,   VX,   M|I8, M|IZ, IE,   __,   IW,   __,   __,   I8,   XX,   __,
+/* D */   M,    M,    M,    M,    XX,   XX,   XX,   __,   M,    M,    M,    M,    M,    M,    M,    M,
+/* E */   R|I8, R|I8, R|I8, R|I8, I8,   I8,   I8,   I8,   R|IZ, R|IZ, XX,   R|I8, __,   __,   __,   __,
+/* F */   P,    __,   P,    P,    __,   __,   M|G3, M|G3, __,   __,   __,   __,   __,   __,   M,    M
+};
+
+// Two-byte opcode map (0F xx), shared by both modes and by VEX/EVEX
+// instructions in the 0F map. 0F 38 and 0F 3A lead to three-byte maps
+// where every opcode takes a MOD-REG-R/M (and in 0F 3A, an imm8), so
+// their entries here already describe the whole instruction and the
+// decoder only has to step over the third opcode byte.
+static const unsigned short x86_opcode_table_0f[256] = {
+/*        0     1     2     3     4     5     6     7     8     9     A     B     C     D     E     F  */
+/* 0 */   M,    M,    M,    M,    XX,   __,   __,   __,   __,   __,   XX,   __,   XX,   M,    __,   M|I8,
+/* 1 */   M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,
+/* 2 */   M,    M,    M,    M,    XX,   XX,   XX,   XX,   M,    M,    M,    M,    M,    M,    M,    M,
+/* 3 */   __,   __,   __,   __,   __,   __,   XX,   __,   X38,  XX,   X3A,  XX,   XX,   XX,   XX,   XX,
+/* 4 */   M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,
+/* 5 */   M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,
+/* 6 */   M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,
+/* 7 */   M|I8, M|I8, M|I8, M|I8, M,    M,    M,    __,   M,    M,    XX,   XX,   M,    M,    M,    M,
+/* 8 */   R|IZ, R|IZ, R|IZ, R|IZ, R|IZ, R|IZ, R|IZ, R|IZ, R|IZ, R|IZ, R|IZ, R|IZ, R|IZ, R|IZ, R|IZ, R|IZ,
+/* 9 */   M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,
+/* A */   __,   __,   __,   M,    M|I8, M,    M,    M,    __,   __,   __,   M,    M|I8, M,    M,    M,
+/* B */   M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M|I8, M,    M,    M,    M,    M,
+/* C */   M,    M,    M|I8, M,    M|I8, M|I8, M|I8, M,    __,   __,   __,   __,   __,   __,   __,   __,
+/* D */   M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,
+/* E */   M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,
+/* F */   M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M
+};
+
+#undef __
+#undef I8
+#undef IW
+#undef IE
+#undef IZ
+#undef IV
+#undef IA
+#undef IF
+#undef G3
+#undef M
+#undef R
+#undef P
+#undef ES
+#undef XX
+#undef VX
+#undef X38
+#undef X3A
+
+// Number of bytes that follow a MOD-REG-R/M byte (SIB and displacement),
+// for 32-bit addressing. MODRM_SIB marks the MOD=00 R/M=100 encodings,
+// whose SIB byte can ask for a 4-byte displacement of its own when its
+// base is 101.
+#define MODRM_SIB 0x80
+// One row is the eight R/M values for a single MOD and REG.
+#define MODRM_ROW(disp,sib,rm5) disp,disp,disp,disp,sib,rm5,disp,disp
 
-int x86_instruction_length (void* codePtr, bool stopOnUnrelocateable) {
-	int length = 0, j;
+static const unsigned char x86_modrm_table[256] = {
+	// MOD 00: [reg], [SIB], [disp32]
+	MODRM_ROW(0,MODRM_SIB|1,4), MODRM_ROW(0,MODRM_SIB|1,4),
+	MODRM_ROW(0,MODRM_SIB|1,4), MODRM_ROW(0,MODRM_SIB|1,4),
+	MODRM_ROW(0,MODRM_SIB|1,4), MODRM_ROW(0,MODRM_SIB|1,4),
+	MODRM_ROW(0,MODRM_SIB|1,4), MODRM_ROW(0,MODRM_SIB|1,4),
+	// MOD 01: [reg+disp8], [SIB+disp8]
+	MODRM_ROW(1,2,1), MODRM_ROW(1,2,1), MODRM_ROW(1,2,1), MODRM_ROW(1,2,1),
+	MODRM_ROW(1,2,1), MODRM_ROW(1,2,1), MODRM_ROW(1,2,1), MODRM_ROW(1,2,1),
+	// MOD 10: [reg+disp32], [SIB+disp32]
+	MODRM_ROW(4,5,4), MODRM_ROW(4,5,4), MODRM_ROW(4,5,4), MODRM_ROW(4,5,4),
+	MODRM_ROW(4,5,4), MODRM_ROW(4,5,4), MODRM_ROW(4,5,4), MODRM_ROW(4,5,4),
+	// MOD 11: register operand, nothing follows
+	MODRM_ROW(0,0,0), MODRM_ROW(0,0,0), MODRM_ROW(0,0,0), MODRM_ROW(0,0,0),
+	MODRM_ROW(0,0,0), MODRM_ROW(0,0,0), MODRM_ROW(0,0,0), MODRM_ROW(0,0,0)
+};
 
-	char operandSize = 4, addressSize = 4;
+#undef MODRM_ROW
 
-	// cast the void pointer to char to make type conversions easier
-	unsigned char* cPtr = (unsigned char*)codePtr;
+// The decoder proper, shared by x86_instruction_length,
+// x86_decode_instruction and the batch x86_decode_boundaries loop so none
+// of them pay for an extra call. insn may be NULL.
+static __inline int x86_decode (const unsigned char* codePtr, int mode,
+                                bool stopOnUnrelocateable,
+                                x86_instruction_t* insn) {
+	unsigned short flags;
+	unsigned char modrm, rex = 0, insnFlags = 0, dispOffset = 0;
+	bool addressOverride = false;
+	const unsigned char* opcode;
+	const unsigned char* opcodeStart;
+	const unsigned char* imm;
+	int map;
+
+	const unsigned short* table;
+	char operandSize = 4, addressSize;
+
+	const unsigned char* cPtr = codePtr;
+
+	table = (mode == X86_MODE_64) ? x86_opcode_table_64 : x86_opcode_table;
 
 	// iterate through bytes until we find one that isn't a prefix
-	for (j = 0; ; j++) {
-		switch (cPtr[j]) {
+	while ((flags = table[*cPtr]) & OP_PREFIX) {
+		switch (*cPtr) {
 			case 0x66:
 				operandSize = 2;
-				length++;
-				continue;
+				break;
 			case 0x67:
-				addressSize = 2;
-				length++;
-				continue;
-			case 0x26: case 0x2E:
-			case 0x36: case 0x3E:
-			case 0x64: case 0x65:
-				length++;
-				continue;
-				// prefix group 1
-			case 0xF0: case 0xF2: case 0xF3:
-				length++;
-				continue;
+				addressOverride = true;
+				break;
+		}
+
+		// REX only counts if it is the last prefix before the
+		// opcode, otherwise the CPU ignores it. (40-4F are only
+		// prefixes in the 64-bit table.)
+		rex = ((*cPtr & 0xF0) == 0x40) ? *cPtr : 0;
+
+		cPtr++;
+
+		// the CPU refuses instructions longer than 15 bytes, and
+		// stopping here keeps a run of prefixes from walking us off
+		// the end of the code we were given. the byte after the last
+		// prefix may not be ours to read, so that prefix is what gets
+		// counted as the failure.
+		if (cPtr - codePtr >= X86_MAX_INSTRUCTION_LENGTH) {
+			x86_decode_failed(codePtr, X86_MAP_ONE_BYTE, cPtr[-1]);
+			return -1;
 		}
-		break;
 	}
 
-	// move our pointer ahead
-	cPtr = &cPtr[j];
+	// REX.W wins over 66
+	if (rex & 8) {
+		operandSize = 8;
+	}
 
+	// 67 halves the address size: 32 to 16, or 64 to 32
+	if (mode == X86_MODE_64) {
+		addressSize = addressOverride ? 4 : 8;
+	} else {
+		addressSize = addressOverride ? 2 : 4;
+	}
 
-	// handle 0x0F opcode set
-	if (*cPtr == 0x0F) {
-		// move our pointer ahead again
-		cPtr = &cPtr[1];
+	opcodeStart = cPtr;
 
-		if (   (*cPtr & 0xF0) == 0x90 // 90-9F
-		    || (*cPtr & 0xF6) == 0xB6 // B6,B7,BE,BF
-		   ) {
-			return length+1+x86_instruction_length_mod_reg_rm(cPtr);
+	// C4/C5/62 are VEX and EVEX prefixes in 64-bit mode. In 32-bit
+	// mode they are LES/LDS/BOUND, which only take memory operands, so
+	// a register MOD (which is what the inverted R/X bits of a real
+	// VEX/EVEX prefix look like) tells them apart.
+	if ((flags & OP_VEX) && (mode == X86_MODE_64
+	                         || (cPtr[1] & 0xC0) == 0xC0)) {
+		switch (*cPtr) {
+			case 0xC5: // C5 RvvvvLpp, always the 0F map
+				map = 1;
+				cPtr += 2;
+				break;
+			case 0xC4: // C4 RXBmmmmm WvvvvLpp
+				map = cPtr[1] & 0x1F;
+				cPtr += 3;
+				break;
+			default:   // 62 RXBR'0mmm Wvvvv1pp zL'LbV'aaa
+				map = cPtr[1] & 0x07;
+				cPtr += 4;
+				break;
 		}
 
-		if ((*cPtr & 0xF0) == 0x80) {
-			if (stopOnUnrelocateable == true) {
-				return -2;
-			}
-			return length+6;
+		switch (map) {
+			case 1: // 0F
+				flags = x86_opcode_table_0f[*cPtr];
+				// there are no VEX branches (or escapes)
+				if (flags & (OP_REL | OP_ESCAPE)) {
+					flags = OP_BAD;
+				}
+				break;
+			case 2: // 0F 38
+			case 5: // EVEX FP16 maps
+			case 6:
+				flags = OP_MODRM;
+				break;
+			case 3: // 0F 3A
+				flags = OP_MODRM | OP_IMM_8;
+				break;
+			default:
+				flags = OP_BAD;
+				break;
 		}
 
-		printf("Opcode 0F %02X @ 0x%08X = ???\n", *cPtr,&cPtr[-1]);
-		return -1;
+		if (flags & OP_BAD) {
+			x86_decode_failed(codePtr, X86_MAP_VEX + (map < 8 ? map : 0),
+			                  *cPtr);
+			return -1;
+		}
 	}
 
-	// FIXME: We don't properly decode FAR CALL 0x9A, but
-	// is it ever used in the wild?
+	// handle 0x0F opcode set
+	else if (flags & OP_ESCAPE) {
+		cPtr++;
+		flags = x86_opcode_table_0f[*cPtr];
 
+		if (flags & OP_BAD) {
+			x86_decode_failed(codePtr, X86_MAP_0F, *cPtr);
+			return -1;
+		}
 
-	// These opcodes refuse to be matchable with bitmasks
-	switch(*cPtr) {
-		case 0xC3: case 0xD7:
-			return length+1;
-		case 0xA8: case 0x6A:
-			return length+2;
-		case 0xC8:
-			return length+4;
-		case 0x68:
-			return length+5;
-		// opcode extensions w/ imm16/32
-		case 0x69:
-			return length + operandSize + x86_instruction_length_mod_reg_rm(cPtr);
-			break;
-		// opcode extensions w/ imm8
-		case 0x6B:
-			return length + 1 + x86_instruction_length_mod_reg_rm(cPtr);
-			break;
+		// 0F 38 and 0F 3A, the third opcode byte doesn't change
+		// anything about the length.
+		if (flags & OP_ESCAPE) {
+			cPtr++;
+		}
+	}
+
+	if (flags & OP_BAD) {
+		x86_decode_failed(codePtr, X86_MAP_ONE_BYTE, *cPtr);
+		return -1;
 	}
-		
-
-	//* experimental bit-matching for 1byte opcodes
-	if (   (*cPtr & 0xC6) == 6 // 06,07,0E,0F...36,37,3E,3F
-	    || (*cPtr & 0xE0) == 0x40 // 0x40-0x5F
-	    || (*cPtr & 0xFE) == 0x60 // 60-61
-	    || (*cPtr & 0x7C) == 0x6C // 6C-6F, EC-EF
-	    || (*cPtr & 0xF0) == 0x90 // 90 - 9F
-	    || (*cPtr & 0xF4) == 0xA4 // A4-A7,AC-AF
-	    || (*cPtr & 0xFE) == 0xAA // AA,AB
-	    || (*cPtr & 0xFD) == 0xC9 // C9, CB
-	    || (*cPtr & 0xFD) == 0xCC // CC, CE
-	    || (*cPtr & 0xF4) == 0xF0 // F0-F3,F8-FB
-	    || (*cPtr & 0xF6) == 0xF4 // F4-F5,FC-FD
-	   ) {
-		return length+1;
-	}
-
-	// relative 2 byte JMPs
-	if (   (*cPtr & 0xF0) == 0x70 // 70-7F
-	    || (*cPtr & 0xF7) == 0xE3 // E3, EB
-	   ) {
+
+	if (flags & OP_REL) {
 		if (stopOnUnrelocateable == true) {
 			return -2;
 		}
-		return length+2;
-	}
+		insnFlags |= X86_INSN_RELATIVE;
 
-	//* experimental bit-matching for 2byte opcodes
-	if (   (*cPtr & 0xC7) == 4    // 4,C,14,1C,24...34,3C
-	    || (*cPtr & 0xF8) == 0xB0 // B0-B7
-	    || (*cPtr & 0xFD) == 0xCD // CD, CF
-	    || (*cPtr & 0xFD) == 0xD0 // D0, D2
-	    || (*cPtr & 0xF8) == 0xE0 // E0-E7
-	   ) {
-		return length+2;
+		// branch displacements don't grow past 32 bits, and Intel
+		// CPUs ignore 66 on them in 64-bit mode.
+		if (mode == X86_MODE_64) {
+			operandSize = 4;
+		}
 	}
 
+	// step over the opcode
+	opcode = cPtr++;
 
-	//* experimental bit-matching for 3byte opcodes
-	if ((*cPtr & 0xF7) == 0xC2) { // C2,CA
-		return length+3;
-	}
+	if (flags & OP_MODRM) {
+		// in 64-bit mode, MOD=00 R/M=101 is [RIP+disp32] rather
+		// than [disp32], and has to be fixed up if moved.
+		if (mode == X86_MODE_64 && (*cPtr & 0xC7) == 0x05) {
+			if (stopOnUnrelocateable == true) {
+				return -2;
+			}
+			insnFlags |= X86_INSN_RIP_RELATIVE;
+			dispOffset = (unsigned char)(cPtr + 1 - codePtr);
+		}
 
-	// MOD-REG-RM
-	if (   (*cPtr & 0xC4) == 0 // 00-03,08-0B,...30-33,38-3B
-	    || (*cPtr & 0xFE) == 0x62 // 62,53
-	    || (*cPtr & 0xFC) == 0x84 // 84-87
-	    || (*cPtr & 0xF8) == 0x88 // 88-8F
-	    || (*cPtr & 0xFE) == 0xFE // FE-FF
-	  ) {
-		return length+x86_instruction_length_mod_reg_rm(cPtr);
+		modrm = x86_modrm_table[*cPtr];
+
+		// if MOD==0 and base==0b101, then the SIB has displacement!
+		if ((modrm & MODRM_SIB) && (cPtr[1]&7) == 5) {
+			cPtr += 4;
+		}
+
+		// step over MOD-REG-R/M, SIB and displacement
+		cPtr += 1 + (modrm & ~MODRM_SIB);
 	}
 
-	// 1 + MOD-REG-RM
-	if (   (*cPtr & 0xFE) == 0x82 // 82, 83
-	    || (*cPtr & 0xFE) == 0xC0 // C0, C1
-	   ) {
-		return length+1+x86_instruction_length_mod_reg_rm(cPtr);
+	imm = cPtr;
+
+	switch (flags & OP_IMM_MASK) {
+		case OP_IMM_8:
+			cPtr += 1;
+			break;
+		case OP_IMM_16:
+			cPtr += 2;
+			break;
+		case OP_IMM_16_8:
+			cPtr += 3;
+			break;
+		case OP_IMM_Z:
+			// 64-bit operands still only take a 32-bit immediate
+			cPtr += (operandSize == 2) ? 2 : 4;
+			break;
+		case OP_IMM_V:
+			cPtr += operandSize;
+			break;
+		case OP_IMM_ADDR:
+			cPtr += addressSize;
+			break;
+		case OP_IMM_FAR:
+			cPtr += 2 + operandSize;
+			break;
+		case OP_IMM_GROUP3:
+			// opcode extension w/ variable arguments: only TEST
+			// has an immediate. F6 is always 8bit, F7 is 16 or 32
+			if (!(opcode[1]&0x30)) {
+				cPtr += (*opcode & 1) ? ((operandSize == 2) ? 2 : 4)
+				                      : 1;
+			}
+			break;
 	}
 
-	// M+1 and M+operandsize placed consecutively
-	if (   (*cPtr & 0xFE) == 0x80 // 80, 81
-	    || (*cPtr & 0xFE) == 0xC6 // C6, C7
-	   ) {
-		return length
-		       + x86_instruction_length_mod_reg_rm(cPtr)
-		       + (((*cPtr&1)==1) ? operandSize : 1);
+	if (insn) {
+		insn->length = (unsigned char)(cPtr - codePtr);
+		insn->flags = insnFlags;
+		insn->opcodeOffset = (unsigned char)(opcodeStart - codePtr);
+		insn->dispOffset = dispOffset;
+		insn->immOffset = (unsigned char)(imm - codePtr);
+		insn->immSize = (unsigned char)(cPtr - imm);
 	}
 
-	// 1 + address size
-	if (   (*cPtr & 0xFC) == 0xA0 // A0-A3
-	    || (*cPtr & 0xF7) == 0x35 // 35, 3D.
-	   ) {
-		return length+1+addressSize;
+	return int(cPtr - codePtr);
+}
+
+int x86_instruction_length (void* codePtr, int mode,
+                            bool stopOnUnrelocateable) {
+	x86_count_decodes(1);
+	return x86_decode((const unsigned char*)codePtr, mode,
+	                  stopOnUnrelocateable, NULL);
+}
+
+int x86_decode_instruction (const void* codePtr, int mode,
+                            x86_instruction_t* insn) {
+	x86_count_decodes(1);
+	return x86_decode((const unsigned char*)codePtr, mode, false, insn);
+}
+
+// x86_decode_boundaries, less keeping count
+static size_t x86_find_boundaries (const void* codePtr, size_t codeLength,
+                                   int mode, unsigned short* offsetsOut,
+                                   size_t maxOut) {
+	// The decoder looks at most a few bytes past the prefixes before it
+	// knows an instruction's length, so as long as we are this far from
+	// the end of the buffer it can run on the caller's memory directly.
+	static const size_t safeMargin = 2*X86_MAX_INSTRUCTION_LENGTH;
+
+	unsigned char tail[2*X86_MAX_INSTRUCTION_LENGTH];
+	const unsigned char* cPtr = (const unsigned char*)codePtr;
+	size_t offset = 0, count = 0, safeLength;
+	int length;
+
+	if (maxOut == 0) {
+		return 0;
 	}
 
-	// 1 + operand size
-	if (   (*cPtr & 0xF8) == 0xB8 // B8-BF
-	    || (*cPtr & 0xC7) == 0x05 // MUST be after evaluating 35 & 3D.
-	    || *cPtr == 0xA9
-        ) {
-		return length+1+operandSize;
+	// offsets have to fit in an unsigned short
+	if (codeLength > 0xFFFF) {
+		codeLength = 0xFFFF;
 	}
+	safeLength = (codeLength > safeMargin) ? codeLength - safeMargin : 0;
 
-	// bizarre opcode extension stuff
-	if ((*cPtr & 0xFE) == 0xF6) { // F6, F7
-		// opcode extension w/ variable arguments
-		length += x86_instruction_length_mod_reg_rm(cPtr);
-		if (!(cPtr[1]&0x30)) {
-			// F6 is always 8bit, F7 is 16 or 32
-			if (*cPtr == 0xF6) {
-				length += 1;
-			} else {
-				length += operandSize;
-			}
+	offsetsOut[count++] = 0;
+
+	// the hot loop: no bounds checks, no copies.
+	while (offset < safeLength && count < maxOut) {
+		length = x86_decode(&cPtr[offset], mode, false, NULL);
+		if (length < 0) {
+			return count;
 		}
-		return length;
+		offset += length;
+		offsetsOut[count++] = (unsigned short)offset;
 	}
 
-	if ((*cPtr & 0xFE) == 0xE8) { //E8,E9
-		if (stopOnUnrelocateable == true) {
-			return -2;
+	// The last few instructions get decoded out of a copy padded with
+	// INT3s, so we never read past the end of the caller's buffer, and
+	// an instruction that is cut off by the end of the buffer is
+	// noticed rather than decoded out of whatever follows it.
+	while (offset < codeLength && count < maxOut) {
+		memset(tail, 0xCC, sizeof(tail));
+		memcpy(tail, &cPtr[offset], codeLength - offset);
+
+		length = x86_decode(tail, mode, false, NULL);
+		if (length < 0 || offset + length > codeLength) {
+			return count;
 		}
-		return length+5;
+		offset += length;
+		offsetsOut[count++] = (unsigned short)offset;
 	}
 
+	return count;
+}
 
-	printf("Opcode %02X @ 0x%08X = ???\n", *cPtr,cPtr);
-	return -1;
+size_t x86_decode_boundaries (const void* codePtr, size_t codeLength,
+                              int mode, unsigned short* offsetsOut,
+                              size_t maxOut) {
+	size_t count = x86_find_boundaries(codePtr, codeLength, mode,
+	                                   offsetsOut, maxOut);
 
-	return length;
+	if (count > 1) {
+		x86_count_decodes(count - 1);
+	}
+	return count;
 }
\ No newline at end of file
@@ -1,5 +1,59 @@
 #pragma once
+#include <stddef.h> // size_t
 
+/**
+ * X86_MAX_INSTRUCTION_LENGTH
+ *
+ * The longest instruction the CPU will execute, in bytes. Anything longer
+ * (in practice, a long run of prefixes) raises #UD.
+ */
+#define X86_MAX_INSTRUCTION_LENGTH 15
+
+/**
+ * X86_MODE_32, X86_MODE_64, X86_MODE_NATIVE
+ *
+ * Values for the mode parameter of the decoding functions, selecting
+ * whether code is decoded as 32-bit protected mode or 64-bit long mode
+ * code. X86_MODE_NATIVE is whichever one this library was compiled for,
+ * and is what bridges are built with.
+ */
+#define X86_MODE_32 32
+#define X86_MODE_64 64
+
+#if defined(_WIN64) || defined(__x86_64__)
+ #define X86_MODE_NATIVE X86_MODE_64
+#else
+ #define X86_MODE_NATIVE X86_MODE_32
+#endif
+
+/**
+ * x86_instruction_t
+ *
+ * Describes a decoded instruction in more detail than just its length,
+ * for code that needs to move instructions around. All offsets are in
+ * bytes from the start of the instruction.
+ */
+struct x86_instruction_t {
+	// total length of the instruction
+	unsigned char length;
+	// X86_INSN_* flags
+	unsigned char flags;
+	// where the opcode starts, after any prefixes. For two-byte opcodes
+	// this points at the 0F, for VEX/EVEX ones at the C4/C5/62.
+	unsigned char opcodeOffset;
+	// where the 32-bit displacement of a RIP-relative memory operand
+	// is, if X86_INSN_RIP_RELATIVE is set.
+	unsigned char dispOffset;
+	// where the immediate is and how big it is. For relative branches
+	// the immediate is the branch displacement.
+	unsigned char immOffset;
+	unsigned char immSize;
+};
+
+// The instruction is a relative JMP, Jcc, CALL, LOOP or JCXZ
+#define X86_INSN_RELATIVE     0x01
+// The instruction has a RIP-relative memory operand (64-bit mode only)
+#define X86_INSN_RIP_RELATIVE 0x02
 
 /**
  * x86_instruction_length
@@ -10,16 +64,150 @@
  * purposes.
  *
  * @param codePtr  A pointer to intel assembly code (function pointer)
+ * @param mode     X86_MODE_32 or X86_MODE_64
  * @param stopOnUnrelocateable If True, the function will not return
  *                             the length of instructions that cannot
  *                             by trivially relocated, instead returning
- *                             -2.
+ *                             -2. These are relative branches and, in
+ *                             64-bit mode, RIP-relative memory operands.
  *
  * @return Length of the instruction. -1 indicates an opcode that was not
  *         properly understood. -2 indicates an instruction that cannot be
  *         trivially relocated if stopOnUnrelocateable is true.
  */
-int x86_instruction_length (void* codePtr, bool stopOnUnrelocateable);
+int x86_instruction_length (void* codePtr, int mode,
+                            bool stopOnUnrelocateable);
+
+/**
+ * x86_decode_instruction
+ *
+ * Decodes a single instruction, like x86_instruction_length, but also
+ * reports where its opcode, immediate and any RIP-relative displacement
+ * are, so it can be relocated.
+ *
+ * @param codePtr  A pointer to intel assembly code
+ * @param mode     X86_MODE_32 or X86_MODE_64
+ * @param insn     Receives the details of the instruction. Left untouched
+ *                 if the instruction could not be decoded.
+ *
+ * @return Length of the instruction, or -1 for an opcode that was not
+ *         properly understood.
+ */
+int x86_decode_instruction (const void* codePtr, int mode,
+                            x86_instruction_t* insn);
+
+/**
+ * x86_decode_boundaries
+ *
+ * Finds the instruction boundaries of a whole region of code in one pass.
+ * This is considerably faster than calling x86_instruction_length in a
+ * loop, and unlike it, never reads outside of the given region.
+ *
+ * Relative branches are decoded like any other instruction, as if
+ * x86_instruction_length had been called with stopOnUnrelocateable set
+ * to false.
+ *
+ * @param codePtr     A pointer to intel assembly code
+ * @param codeLength  The length of the region in bytes. Since offsets are
+ *                    written as unsigned shorts, at most 65535 bytes are
+ *                    scanned per call; larger regions can be scanned by
+ *                    calling again from the last offset returned.
+ * @param mode        X86_MODE_32 or X86_MODE_64
+ * @param offsetsOut  Receives the offset of every instruction boundary,
+ *                    starting with 0 and ending with the offset decoding
+ *                    stopped at.
+ * @param maxOut      The number of entries offsetsOut has room for.
+ *
+ * @return The number of offsets written, which is one more than the
+ *         number of instructions decoded. Decoding stops early at an
+ *         opcode that is not understood, or at an instruction that would
+ *         run past codeLength. In either case the last offset written is
+ *         where the offending instruction starts.
+ */
+size_t x86_decode_boundaries (const void* codePtr, size_t codeLength,
+                              int mode, unsigned short* offsetsOut,
+                              size_t maxOut);
+
+/**
+ * X86_MAP_ONE_BYTE, X86_MAP_0F, X86_MAP_VEX
+ *
+ * Which opcode map an opcode the decoder didn't understand is in, as
+ * given to the failure hook and used to index failuresByOpcode in
+ * x86_stats_t. VEX and EVEX opcodes are X86_MAP_VEX plus the map number
+ * from their prefix (1 for 0F, 2 for 0F 38 and so on). Maps past 7 don't
+ * exist, and are all counted as map 0, which doesn't either.
+ */
+#define X86_MAP_ONE_BYTE 0
+#define X86_MAP_0F       1
+#define X86_MAP_VEX      8
+#define X86_NUM_MAPS     16
+
+/**
+ * x86_stats_t
+ *
+ * Running totals kept by the decoder and bridge_create since the program
+ * started, for x86_get_stats.
+ */
+struct x86_stats_t {
+	// instructions decoded, by any of the decoding functions (counting
+	// the ones x86_instruction_length and x86_decode_instruction fail
+	// on). Threads add theirs a few hundred at a time, so it's only
+	// about right.
+	unsigned long long decodes;
+	// opcodes that weren't understood, in total and by map and opcode
+	unsigned long long failures;
+	unsigned long long failuresByOpcode[X86_NUM_MAPS][256];
+	// instructions moved into bridges, and how many of those were
+	// relative branches or RIP-relative that had to be re-encoded
+	unsigned long long moved;
+	unsigned long long relocations;
+};
+
+/**
+ * x86_get_stats
+ *
+ * Takes a snapshot of the decoder's statistics. The counters are kept
+ * without any locking, so when other threads are decoding at the same
+ * time, each one is up to date on its own but they may not quite add up
+ * with each other.
+ *
+ * @param stats  Receives the statistics.
+ */
+void x86_get_stats (x86_stats_t* stats);
+
+/**
+ * x86_failure_hook_t
+ *
+ * Called by the decoder whenever it comes across an opcode it doesn't
+ * understand, with where the instruction starts, the X86_MAP_* map the
+ * opcode is in and the opcode itself. An instruction that is still all
+ * prefixes after 15 bytes is given as the last of them, in the one byte
+ * map. (The last few instructions of a region given to
+ * x86_decode_boundaries are decoded out of a copy of them, so for those
+ * it's where the copy is.)
+ */
+typedef void (*x86_failure_hook_t)(const void* instruction, int map,
+                                   unsigned char opcode);
+
+/**
+ * x86_set_failure_hook
+ *
+ * Sets the function to be called when decoding fails, or NULL (which is
+ * what it starts out as) for failures to only be counted. It's called
+ * from whichever thread was decoding, while it decodes, so it should be
+ * quick about it.
+ *
+ * @param hook  The function to call, e.g. x86_log_failure.
+ */
+void x86_set_failure_hook (x86_failure_hook_t hook);
+
+/**
+ * x86_log_failure
+ *
+ * A failure hook that prints the opcode and its address to stderr.
+ */
+void x86_log_failure (const void* instruction, int map,
+                      unsigned char opcode);
 
 /**
  * bridge_create
@@ -28,9 +216,31 @@ int x86_instruction_length (void* codePtr, bool stopOnUnrelocateable);
  * calling the original versions of hooked functions without having to
  * temporarily rewrite the hook in memory.
  *
+ * The first 5 bytes worth of instructions are moved into the bridge.
+ * Relative JMPs, Jccs, CALLs, LOOPs and JCXZs among them are re-encoded
+ * to still reach their targets: short branches are widened to rel32, and
+ * in 64-bit mode, targets out of rel32 range are reached through an
+ * absolute jump. Branches back into the moved instructions themselves
+ * can't be bridged.
+ *
+ * RIP-relative operands (64-bit mode) are rebased the same way. When the
+ * operand is out of rel32 reach from the bridge, LEA and MOV loads are
+ * rewritten to fetch its address from a literal pool at the end of the
+ * bridge; any other instruction makes bridge creation fail.
+ *
+ * When creating or destroying many bridges at once, wrap the calls in
+ * codepool_begin_write and codepool_commit, so the memory they live in
+ * is only write-protected once at the end instead of once per bridge.
+ *
+ * There is only ever one bridge per function. Creating a bridge for a
+ * function that already has one returns the same bridge again, and it
+ * is only really destroyed once bridge_destroy has been called for it as
+ * many times as it was created. So it's fine for a function to be hooked
+ * already, as long as its bridge was created before it was.
+ *
  * @param hookedFunction  A function pointer to the function that will be
- *        hooked. The function must not already be hooked to prevent
- *        recursion.
+ *        hooked. Unless it already has a bridge, the function must not
+ *        already be hooked to prevent recursion.
  *
  * @return A function pointer that can be used to call the unhooked
  *         function. Normal use would typecast this to the appropriate
@@ -38,10 +248,30 @@ int x86_instruction_length (void* codePtr, bool stopOnUnrelocateable);
  */
 void* bridge_create (void* unhookedFunction);
 
+/**
+ * bridge_cache_enable
+ *
+ * Turns remembering decoded prologues on or off. While it's on,
+ * bridge_create keeps the instructions it decoded for each function,
+ * along with the bytes they were decoded from, and the next bridge for
+ * the same function skips decoding as long as the function still starts
+ * with the same bytes. Bridges destroyed while it's on aren't freed but
+ * kept with their function's plan, and the next bridge_create for it
+ * hands the same bridge back without building anything. Worth it when
+ * the same functions get hooked and unhooked again and again.
+ *
+ * It's off to begin with. Turning it off forgets everything and frees
+ * the kept bridges.
+ *
+ * @param enable  Whether to keep decoded prologues.
+ */
+void bridge_cache_enable (bool enable);
+
 /**
  * bridge_destroy
  *
- * Destroys a previously created bridge.
+ * Destroys a previously created bridge, once every bridge_create that
+ * returned it has been matched by a bridge_destroy.
  *
  * @param bridge  The bridge t0 destroy, freeing its resources.
  */
@@ -0,0 +1,1147 @@
+#include "hook.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../bridgebuilder.h"
+#include "../mem/codepool.h"
+#ifdef _WIN32
+ #define WIN32_LEAN_AND_MEAN
+ #include <Windows.h>
+ #include <TlHelp32.h>
+#else
+ #include <unistd.h>
+ #include <pthread.h>
+ #include <time.h>
+ #include <sys/mman.h>
+#endif
+#ifdef __linux__
+ #include <dirent.h>
+ #include <errno.h>
+ #include <signal.h>
+ #include <ucontext.h>
+ #include <sys/syscall.h>
+ #include <linux/futex.h>
+#endif
+
+// JMP rel32, written over the start of the hooked function
+#define HOOK_JMP_SIZE 5
+
+// JMP [RIP+0] and the address, for detours out of rel32 reach
+#define HOOK_RELAY_SIZE 14
+
+// A batch stops every other thread while it patches, and tries again
+// (up to this many times) if any of them was stopped in the middle of
+// the bytes being replaced.
+#define HOOK_SUSPEND_TRIES 50
+
+// How long to wait for a thread to stop, in milliseconds, before going
+// ahead without it.
+#define HOOK_SUSPEND_TIMEOUT 100
+
+// On Linux, threads are stopped by sending them this signal, so it
+// can't be used for anything else.
+#if defined(__linux__) && !defined(HOOK_SUSPEND_SIGNAL)
+ #define HOOK_SUSPEND_SIGNAL (SIGRTMIN+5)
+#endif
+
+// what hook_unprotect_batch leaves for targets it didn't need to unprotect
+#define HOOK_PROTECT_SHARED ((unsigned long)-1)
+
+// The most detours one function can have at once.
+#define HOOK_MAX_DETOURS 8
+
+// Once a function has more than one detour, it jumps to a dispatch stub
+// instead: an indirect JMP per entry, HOOK_STUB_ENTRY_SIZE bytes apart,
+// followed by the pointers they jump through. Entry 0 is where the
+// function jumps to, and goes to the first detour. The others are the
+// detours' ways on down the chain, each going to the detour after it
+// (or the bridge, for the last one). Moving a detour in or out of the
+// chain is then just a pointer store or two.
+#define HOOK_STUB_ENTRIES    (HOOK_MAX_DETOURS+1)
+#define HOOK_STUB_ENTRY_SIZE 8
+#define HOOK_STUB_SIZE       (HOOK_STUB_ENTRIES \
+                              * (HOOK_STUB_ENTRY_SIZE + sizeof(void*)))
+
+// JMP $, the two bytes threads spin on while the rest of a JMP that
+// can't be written in one go is filled in (EB FE, little-endian).
+#define HOOK_SPIN 0xFEEB
+
+struct hook_t {
+	unsigned char* target;
+	void* bridge;
+	// the absolute jump to the first detour, if it needed one
+	unsigned char* relay;
+	// what was at target before, and the JMP that's there now
+	unsigned char original[HOOK_JMP_SIZE];
+	unsigned char jump[HOOK_JMP_SIZE];
+	// the JMP to the first detour, for when it's the only one
+	unsigned char direct[HOOK_JMP_SIZE];
+
+	// the detours, in the order they're called. New ones go in front.
+	void* detours[HOOK_MAX_DETOURS];
+	size_t numDetours;
+	// the stub entry each detour goes on down the chain through. 0 for
+	// the first detour, which was given the bridge itself.
+	unsigned char entries[HOOK_MAX_DETOURS];
+	// a bit for each entry whose detour was taken out. Somebody could
+	// still be in it and on their way through the entry, so it isn't
+	// given to another detour until the whole hook is removed.
+	unsigned int retired;
+
+	// the dispatch stub, once there's been more than one detour, where
+	// to write to it, and whether the function jumps to it right now
+	unsigned char* stub;
+	unsigned char* stubWrite;
+	bool viaStub;
+};
+
+static hook_t* hooks = NULL;
+static size_t numHooks = 0;
+
+static size_t pageSize = 0;
+
+// The other threads of the process, while a batch has them stopped.
+// Where each one was stopped is 0 until it's known.
+struct hookthread_t {
+	#ifdef _WIN32
+		DWORD id;
+		HANDLE handle;
+	#else
+		pid_t id;
+	#endif
+	size_t volatile ip;
+};
+
+static hookthread_t* threads = NULL;
+static size_t numThreads = 0;
+static size_t maxThreads = 0;
+
+#ifdef __linux__
+ // how many threads have stopped in hook_suspend_handler so far, and
+ // which stop they stopped for, and the last one they can go on from.
+ static int volatile numStopped = 0;
+ static unsigned int volatile suspendGen = 0;
+ static unsigned int volatile resumeGen = 0;
+ static bool handlerInstalled = false;
+#endif
+
+#ifdef _WIN32
+ static SRWLOCK hookLock = SRWLOCK_INIT;
+#else
+ static pthread_mutex_t hookLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+__inline void hook_enter (void) {
+	#ifdef _WIN32
+		AcquireSRWLockExclusive(&hookLock);
+	#else
+		pthread_mutex_lock(&hookLock);
+	#endif
+}
+
+__inline void hook_leave (void) {
+	#ifdef _WIN32
+		ReleaseSRWLockExclusive(&hookLock);
+	#else
+		pthread_mutex_unlock(&hookLock);
+	#endif
+}
+
+__inline bool hook_cas64 (unsigned long long volatile* word,
+                          unsigned long long oldValue,
+                          unsigned long long newValue) {
+	#ifdef _WIN32
+		return InterlockedCompareExchange64((LONGLONG volatile*)word,
+		                                    (LONGLONG)newValue,
+		                                    (LONGLONG)oldValue)
+		       == (LONGLONG)oldValue;
+	#else
+		return __sync_bool_compare_and_swap(word, oldValue, newValue);
+	#endif
+}
+
+__inline bool hook_cas16 (unsigned short volatile* half,
+                          unsigned short oldValue, unsigned short newValue) {
+	#ifdef _WIN32
+		return InterlockedCompareExchange16((SHORT volatile*)half,
+		                                    (SHORT)newValue, (SHORT)oldValue)
+		       == (SHORT)oldValue;
+	#else
+		return __sync_bool_compare_and_swap(half, oldValue, newValue);
+	#endif
+}
+
+// must hold the lock
+static hook_t* hook_find (void* target) {
+	size_t j;
+
+	for (j = 0; j < numHooks; j++) {
+		if (hooks[j].target == target) {
+			return &hooks[j];
+		}
+	}
+	return NULL;
+}
+
+#ifndef _WIN32
+// Looks up the protection of the mapping address is in. There's no
+// call for that, so it has to come out of /proc/self/maps.
+static int hook_get_protection (void* address) {
+	unsigned long long start, end;
+	char perms[5];
+	int protection = PROT_READ | PROT_EXEC;
+	FILE* maps;
+
+	maps = fopen("/proc/self/maps", "r");
+	if (maps == NULL) {
+		return protection;
+	}
+	while (fscanf(maps, "%llx-%llx %4s%*[^\n]", &start, &end, perms) == 3) {
+		if (size_t(address) >= start && size_t(address) < end) {
+			protection = PROT_NONE;
+			if (perms[0] == 'r') protection |= PROT_READ;
+			if (perms[1] == 'w') protection |= PROT_WRITE;
+			if (perms[2] == 'x') protection |= PROT_EXEC;
+			break;
+		}
+	}
+	fclose(maps);
+	return protection;
+}
+#endif
+
+// the start of the page address is in
+static unsigned char* hook_page (unsigned char* address) {
+	if (pageSize == 0) {
+		#ifdef _WIN32
+			SYSTEM_INFO sysInfo;
+			GetSystemInfo(&sysInfo);
+			pageSize = sysInfo.dwPageSize;
+		#else
+			pageSize = sysconf(_SC_PAGESIZE);
+		#endif
+	}
+	return (unsigned char*)(size_t(address) & ~(pageSize-1));
+}
+
+// Sets a page's protection back to what hook_unprotect found it at.
+static void hook_protect_page (unsigned char* page, unsigned long protection) {
+	#ifdef _WIN32
+		DWORD oldProtect;
+
+		VirtualProtect(page, pageSize, protection, &oldProtect);
+	#else
+		mprotect(page, pageSize, (int)protection);
+	#endif
+}
+
+// Makes the page (or two) the JMP at target lands on writeable, without
+// taking away execute since other threads may be running it, and
+// remembers what their protection was in oldProtect. must hold the lock
+static bool hook_unprotect (unsigned char* target, unsigned long* oldProtect) {
+	unsigned char* page = hook_page(target);
+	size_t j, numPages;
+
+	numPages = (hook_page(target + HOOK_JMP_SIZE-1) != page) ? 2 : 1;
+
+	for (j = 0; j < numPages; j++) {
+		#ifdef _WIN32
+			if (VirtualProtect(page + j*pageSize, pageSize,
+			                   PAGE_EXECUTE_READWRITE,
+			                   &oldProtect[j]) == 0) {
+				break;
+			}
+		#else
+			oldProtect[j] = hook_get_protection(page + j*pageSize);
+			if (mprotect(page + j*pageSize, pageSize,
+			             PROT_READ | PROT_WRITE | PROT_EXEC) != 0) {
+				break;
+			}
+		#endif
+	}
+	if (j == numPages) {
+		return true;
+	}
+
+	// put back the ones that worked
+	while (j-- > 0) {
+		hook_protect_page(page + j*pageSize, oldProtect[j]);
+	}
+	return false;
+}
+
+// Undoes hook_unprotect. must hold the lock
+static void hook_reprotect (unsigned char* target, unsigned long* oldProtect) {
+	unsigned char* page = hook_page(target);
+
+	hook_protect_page(page, oldProtect[0]);
+	if (hook_page(target + HOOK_JMP_SIZE-1) != page) {
+		hook_protect_page(page + pageSize, oldProtect[1]);
+	}
+
+	#ifdef _WIN32
+		FlushInstructionCache(GetCurrentProcess(), target, HOOK_JMP_SIZE);
+	#endif
+}
+
+// Atomically replaces the HOOK_JMP_SIZE bytes at target with newCode, as
+// long as they are still oldCode. The memory has to be writeable.
+static bool hook_write_code (unsigned char* target,
+                             const unsigned char* oldCode,
+                             const unsigned char* newCode) {
+	size_t offset = size_t(target) & 7;
+	unsigned long long volatile* word;
+	unsigned long long oldWord, newWord;
+	unsigned short volatile* half;
+	unsigned short oldHalf, newHalf;
+
+	// The easy way: it all fits in one word. The bytes around it in the
+	// word may belong to some other function that's being patched too,
+	// so keep trying until nobody else gets in between.
+	if (offset + HOOK_JMP_SIZE <= sizeof(oldWord)) {
+		word = (unsigned long long volatile*)(target - offset);
+		do {
+			oldWord = *word;
+			if (memcmp((unsigned char*)&oldWord + offset, oldCode,
+			           HOOK_JMP_SIZE) != 0) {
+				return false;
+			}
+			newWord = oldWord;
+			memcpy((unsigned char*)&newWord + offset, newCode, HOOK_JMP_SIZE);
+		} while (hook_cas64(word, oldWord, newWord) == false);
+		return true;
+	}
+
+	// Otherwise, park anyone who comes in on a JMP $ while the rest of
+	// it is written. Those first two bytes have to stay inside one cache
+	// line to be swapped atomically.
+	if ((size_t(target) & 63) == 63
+	    || memcmp(&target[2], &oldCode[2], HOOK_JMP_SIZE-2) != 0) {
+		return false;
+	}
+
+	half = (unsigned short volatile*)target;
+	memcpy(&oldHalf, oldCode, sizeof(oldHalf));
+	memcpy(&newHalf, newCode, sizeof(newHalf));
+	if (hook_cas16(half, oldHalf, HOOK_SPIN) == false) {
+		return false;
+	}
+	memcpy(&target[2], &newCode[2], HOOK_JMP_SIZE-2);
+	hook_cas16(half, HOOK_SPIN, newHalf);
+
+	return true;
+}
+
+// Works out the JMP from hook->target to detour, making a relay for
+// it if it's too far away.
+static bool hook_make_jump (hook_t* hook, void* detour) {
+	size_t from = size_t(hook->target) + HOOK_JMP_SIZE;
+	size_t to = size_t(detour);
+
+	#if X86_MODE_NATIVE == X86_MODE_64
+		static const unsigned char jmpAbs[] = { 0xFF, 0x25, 0, 0, 0, 0 };
+		unsigned char* relayWrite;
+		long long distance = (long long)(to - from);
+
+		if (distance != (long long)(int)distance) {
+			hook->relay = (unsigned char*)codepool_alloc(HOOK_RELAY_SIZE,
+			                                             hook->target,
+			                                             (void**)&relayWrite);
+			if (hook->relay == NULL) {
+				return false;
+			}
+			codepool_unlock(hook->relay);
+			memcpy(relayWrite, jmpAbs, sizeof(jmpAbs));
+			memcpy(&relayWrite[sizeof(jmpAbs)], &to, sizeof(to));
+			codepool_lock(hook->relay);
+
+			to = size_t(hook->relay);
+		}
+	#endif
+
+	hook->jump[0] = 0xE9;
+	*(int*)&hook->jump[1] = (int)(to - from);
+	return true;
+}
+
+// Gets the bridge, the JMP and the relay for a hook ready, without
+// touching the function yet. must hold the lock
+static bool hook_prepare (hook_t* hook, void* target, void* detour) {
+	// The bridge is made from these bytes, and the hook only goes in if
+	// they're still the same by then.
+	hook->target = (unsigned char*)target;
+	hook->relay = NULL;
+	memcpy(hook->original, target, HOOK_JMP_SIZE);
+
+	hook->detours[0] = detour;
+	hook->entries[0] = 0;
+	hook->numDetours = 1;
+	hook->stub = NULL;
+	hook->viaStub = false;
+	hook->retired = 0;
+
+	hook->bridge = bridge_create(target);
+	if (hook->bridge == NULL) {
+		return false;
+	}
+	if (hook_make_jump(hook, detour) == false) {
+		bridge_destroy(hook->bridge);
+		return false;
+	}
+	memcpy(hook->direct, hook->jump, HOOK_JMP_SIZE);
+	return true;
+}
+
+// frees what hook_prepare (and hook_chain_add) made
+static void hook_discard (hook_t* hook) {
+	bridge_destroy(hook->bridge);
+	codepool_free(hook->relay);
+	codepool_free(hook->stub);
+}
+
+// Points one of the stub's entries somewhere else. A single aligned
+// pointer store, so a thread going through it sees either the old place
+// or the new one.
+static void hook_stub_set (hook_t* hook, size_t entry, void* to) {
+	void** slot = (void**)(hook->stubWrite 
+	                       + HOOK_STUB_ENTRIES*HOOK_STUB_ENTRY_SIZE
+	                       + entry*sizeof(void*));
+
+	codepool_unlock(hook->stub);
+	#ifdef _WIN32
+		InterlockedExchangePointer(slot, to);
+	#else
+		__atomic_store_n(slot, to, __ATOMIC_RELEASE);
+	#endif
+	codepool_lock(hook->stub);
+}
+
+// Makes the dispatch stub, with every entry going to the bridge for now.
+// must hold the lock
+static bool hook_make_stub (hook_t* hook) {
+	unsigned char* entry;
+	size_t j, slot;
+
+	hook->stub = (unsigned char*)codepool_alloc(HOOK_STUB_SIZE, hook->target,
+	                                            (void**)&hook->stubWrite);
+	if (hook->stub == NULL) {
+		return false;
+	}
+
+	codepool_unlock(hook->stub);
+	for (j = 0; j < HOOK_STUB_ENTRIES; j++) {
+		// JMP [slot], RIP-relative in 64-bit code and absolute in 32-bit
+		entry = &hook->stubWrite[j*HOOK_STUB_ENTRY_SIZE];
+		slot = size_t(hook->stub) + HOOK_STUB_ENTRIES*HOOK_STUB_ENTRY_SIZE
+		       + j*sizeof(void*);
+		entry[0] = 0xFF;
+		entry[1] = 0x25;
+		#if X86_MODE_NATIVE == X86_MODE_64
+			*(int*)&entry[2] = (int)(slot - (size_t(hook->stub) 
+			                                 + j*HOOK_STUB_ENTRY_SIZE + 6));
+		#else
+			*(int*)&entry[2] = (int)slot;
+		#endif
+		*(void**)&hook->stubWrite[slot - size_t(hook->stub)] = hook->bridge;
+	}
+	codepool_lock(hook->stub);
+
+	return true;
+}
+
+// Points every entry in the stub where it should go now. Back to front,
+// so by the time a detour can be reached, where it goes on to is right.
+// must hold the lock
+static void hook_stub_link (hook_t* hook) {
+	size_t j;
+
+	for (j = hook->numDetours; j-- > 0; ) {
+		if (hook->entries[j] != 0) {
+			hook_stub_set(hook, hook->entries[j],
+			              (j+1 < hook->numDetours) ? hook->detours[j+1]
+			                                       : hook->bridge);
+		}
+	}
+	hook_stub_set(hook, 0, hook->detours[0]);
+}
+
+// Atomically swaps the JMP at the start of the function for another one.
+// must hold the lock
+static bool hook_retarget (hook_t* hook, const unsigned char* jump) {
+	unsigned long oldProtect[2];
+	bool written;
+
+	if (hook_unprotect(hook->target, oldProtect) == false) {
+		return false;
+	}
+	written = hook_write_code(hook->target, hook->jump, jump);
+	hook_reprotect(hook->target, oldProtect);
+
+	if (written == true) {
+		memcpy(hook->jump, jump, HOOK_JMP_SIZE);
+	}
+	return written;
+}
+
+// Puts another detour in front of an already hooked function's. must
+// hold the lock
+static bool hook_chain_add (hook_t* hook, void* detour, void** next) {
+	unsigned char jump[HOOK_JMP_SIZE];
+	void* oldNext;
+	size_t entry, j;
+
+	if (hook->numDetours == HOOK_MAX_DETOURS) {
+		return false;
+	}
+	for (j = 0; j < hook->numDetours; j++) {
+		if (hook->detours[j] == detour) {
+			return false;
+		}
+	}
+
+	if (hook->stub == NULL && hook_make_stub(hook) == false) {
+		return false;
+	}
+
+	// find an entry none of the other detours are using, or ever did
+	for (entry = 1; entry < HOOK_STUB_ENTRIES; entry++) {
+		if (hook->retired & (1u << entry)) {
+			continue;
+		}
+		for (j = 0; j < hook->numDetours; j++) {
+			if (hook->entries[j] == entry) {
+				break;
+			}
+		}
+		if (j == hook->numDetours) {
+			break;
+		}
+	}
+	if (entry == HOOK_STUB_ENTRIES) {
+		return false;
+	}
+
+	// the detour can be reached as soon as it's linked in
+	oldNext = *next;
+	*next = hook->stub + entry*HOOK_STUB_ENTRY_SIZE;
+
+	memmove(&hook->detours[1], &hook->detours[0],
+	        sizeof(void*) * hook->numDetours);
+	memmove(&hook->entries[1], &hook->entries[0], hook->numDetours);
+	hook->detours[0] = detour;
+	hook->entries[0] = (unsigned char)entry;
+	hook->numDetours++;
+	hook_stub_link(hook);
+
+	// the function still jumps straight to the old detour
+	if (hook->viaStub == false) {
+		jump[0] = 0xE9;
+		*(int*)&jump[1] = (int)(size_t(hook->stub) 
+		                        - (size_t(hook->target) + HOOK_JMP_SIZE));
+		if (hook_retarget(hook, jump) == false) {
+			hook->numDetours--;
+			memmove(&hook->detours[0], &hook->detours[1],
+			        sizeof(void*) * hook->numDetours);
+			memmove(&hook->entries[0], &hook->entries[1], hook->numDetours);
+			hook_stub_link(hook);
+			*next = oldNext;
+			return false;
+		}
+		hook->viaStub = true;
+	}
+
+	return true;
+}
+
+// adds a thread to the list hook_list_threads is making
+static void hook_add_thread (size_t id) {
+	hookthread_t* newThreads;
+
+	if (numThreads == maxThreads) {
+		newThreads = (hookthread_t*)realloc(threads,
+		                   sizeof(hookthread_t) * (maxThreads*2 + 16));
+		if (newThreads == NULL) {
+			return;
+		}
+		threads = newThreads;
+		maxThreads = maxThreads*2 + 16;
+	}
+
+	memset(&threads[numThreads], 0, sizeof(hookthread_t));
+	#ifdef _WIN32
+		threads[numThreads].id = (DWORD)id;
+	#else
+		threads[numThreads].id = (pid_t)id;
+	#endif
+	numThreads++;
+}
+
+// Makes a list of every other thread in the process. must hold the lock
+static void hook_list_threads (void) {
+	numThreads = 0;
+
+	#ifdef _WIN32
+		HANDLE snapshot;
+		THREADENTRY32 entry;
+		BOOL more;
+
+		snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+		if (snapshot == INVALID_HANDLE_VALUE) {
+			return;
+		}
+		entry.dwSize = sizeof(entry);
+		for (more = Thread32First(snapshot, &entry); more != FALSE;
+		     more = Thread32Next(snapshot, &entry)) {
+			if (entry.th32OwnerProcessID == GetCurrentProcessId()
+			    && entry.th32ThreadID != GetCurrentThreadId()) {
+				hook_add_thread(entry.th32ThreadID);
+			}
+		}
+		CloseHandle(snapshot);
+	#elif defined(__linux__)
+		DIR* tasks;
+		struct dirent* entry;
+		size_t self = (size_t)syscall(SYS_gettid);
+
+		tasks = opendir("/proc/self/task");
+		if (tasks == NULL) {
+			return;
+		}
+		while ((entry = readdir(tasks)) != NULL) {
+			if (entry->d_name[0] != '.'
+			    && (size_t)atoi(entry->d_name) != self) {
+				hook_add_thread(atoi(entry->d_name));
+			}
+		}
+		closedir(tasks);
+	#endif
+
+	// anywhere else, there's no finding them. The patches are still
+	// atomic though.
+}
+
+#ifdef __linux__
+// Runs on each thread that gets HOOK_SUSPEND_SIGNAL: says where the
+// thread was, and waits there until the batch is done. Only
+// async-signal-safe stuff in here.
+static void hook_suspend_handler (int sig, siginfo_t* info, void* context) {
+	ucontext_t* ucontext = (ucontext_t*)context;
+	unsigned int gen = __atomic_load_n(&suspendGen, __ATOMIC_ACQUIRE);
+	pid_t self = (pid_t)syscall(SYS_gettid);
+	int savedErrno = errno;
+	size_t j;
+
+	// a signal left over from a stop that went ahead without us, which
+	// is over now. (the thread list may be getting rebuilt, too.)
+	if (__atomic_load_n(&resumeGen, __ATOMIC_ACQUIRE) == gen) {
+		return;
+	}
+
+	for (j = 0; j < numThreads; j++) {
+		if (threads[j].id == self) {
+			#if defined(__x86_64__)
+				threads[j].ip = ucontext->uc_mcontext.gregs[REG_RIP];
+			#else
+				threads[j].ip = ucontext->uc_mcontext.gregs[REG_EIP];
+			#endif
+			__atomic_add_fetch(&numStopped, 1, __ATOMIC_RELEASE);
+			syscall(SYS_futex, &numStopped, FUTEX_WAKE_PRIVATE, 1,
+			        NULL, NULL, 0);
+			break;
+		}
+	}
+
+	while (__atomic_load_n(&resumeGen, __ATOMIC_ACQUIRE) != gen) {
+		syscall(SYS_futex, &resumeGen, FUTEX_WAIT_PRIVATE, resumeGen,
+		        NULL, NULL, 0);
+	}
+	errno = savedErrno;
+}
+#endif
+
+// Stops every thread from hook_list_threads, and finds out where each
+// one was stopped. must hold the lock
+static void hook_suspend_threads (void) {
+	size_t j;
+
+	#ifdef _WIN32
+		CONTEXT context;
+
+		for (j = 0; j < numThreads; j++) {
+			threads[j].handle = OpenThread(THREAD_SUSPEND_RESUME
+			                                 | THREAD_GET_CONTEXT,
+			                               FALSE, threads[j].id);
+			if (threads[j].handle == NULL) {
+				continue;
+			}
+			if (SuspendThread(threads[j].handle) == (DWORD)-1) {
+				CloseHandle(threads[j].handle);
+				threads[j].handle = NULL;
+				continue;
+			}
+			// this also waits for the thread to actually stop
+			context.ContextFlags = CONTEXT_CONTROL;
+			if (GetThreadContext(threads[j].handle, &context) != 0) {
+				#ifdef _WIN64
+					threads[j].ip = context.Rip;
+				#else
+					threads[j].ip = context.Eip;
+				#endif
+			}
+		}
+	#elif defined(__linux__)
+		struct sigaction action;
+		struct timespec start, now, timeout;
+		long long waited;
+		size_t numSignalled = 0;
+		int stopped;
+
+		if (handlerInstalled == false) {
+			memset(&action, 0, sizeof(action));
+			action.sa_sigaction = hook_suspend_handler;
+			action.sa_flags = SA_SIGINFO | SA_RESTART;
+			sigfillset(&action.sa_mask);
+			if (sigaction(HOOK_SUSPEND_SIGNAL, &action, NULL) != 0) {
+				return;
+			}
+			handlerInstalled = true;
+		}
+
+		__atomic_store_n(&numStopped, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&suspendGen, suspendGen+1, __ATOMIC_RELEASE);
+
+		for (j = 0; j < numThreads; j++) {
+			if (syscall(SYS_tgkill, getpid(), threads[j].id,
+			            HOOK_SUSPEND_SIGNAL) == 0) {
+				numSignalled++;
+			}
+		}
+
+		// Threads that have the signal blocked will never stop. Anyone
+		// who hasn't by the timeout is left running; the patches are
+		// atomic, so they'll most likely be fine anyway.
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		while ((size_t)(stopped = __atomic_load_n(&numStopped, __ATOMIC_ACQUIRE))
+		         < numSignalled) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			waited = (now.tv_sec - start.tv_sec) * 1000000000LL
+			         + (now.tv_nsec - start.tv_nsec);
+			if (waited >= HOOK_SUSPEND_TIMEOUT * 1000000LL) {
+				break;
+			}
+			timeout.tv_sec = 0;
+			timeout.tv_nsec = HOOK_SUSPEND_TIMEOUT * 1000000LL - waited;
+			syscall(SYS_futex, &numStopped, FUTEX_WAIT_PRIVATE, stopped,
+			        &timeout, NULL, 0);
+		}
+	#endif
+}
+
+// lets everything hook_suspend_threads stopped go again
+static void hook_resume_threads (void) {
+	#ifdef _WIN32
+		size_t j;
+
+		for (j = 0; j < numThreads; j++) {
+			if (threads[j].handle != NULL) {
+				ResumeThread(threads[j].handle);
+				CloseHandle(threads[j].handle);
+				threads[j].handle = NULL;
+			}
+		}
+	#elif defined(__linux__)
+		__atomic_store_n(&resumeGen, suspendGen, __ATOMIC_RELEASE);
+		syscall(SYS_futex, &resumeGen, FUTEX_WAKE_PRIVATE, 0x7FFFFFFF,
+		        NULL, NULL, 0);
+	#endif
+}
+
+// Is any stopped thread in the middle of the bytes about to be patched?
+// (right at the start is fine, it'll just run the new code.)
+static bool hook_threads_clear (hook_t* batch, size_t count) {
+	size_t j, k;
+
+	for (j = 0; j < numThreads; j++) {
+		for (k = 0; k < count; k++) {
+			if (threads[j].ip > size_t(batch[k].target)
+			    && threads[j].ip < size_t(batch[k].target) + HOOK_JMP_SIZE) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static void hook_reprotect_batch (hook_t* batch, size_t count,
+                                  unsigned long* oldProtect) {
+	size_t j;
+
+	for (j = count; j-- > 0; ) {
+		if (oldProtect[j*2] != HOOK_PROTECT_SHARED) {
+			hook_reprotect(batch[j].target, &oldProtect[j*2]);
+		}
+	}
+
+	#ifdef _WIN32
+		for (j = 0; j < count; j++) {
+			FlushInstructionCache(GetCurrentProcess(), batch[j].target,
+			                      HOOK_JMP_SIZE);
+		}
+	#endif
+}
+
+// Writes every patch in a batch (or takes every one out) while all the
+// other threads are stopped. Either all of them are written, or none.
+// The pages have to be writeable. must hold the lock
+static bool hook_patch_batch (hook_t* batch, size_t count, bool remove) {
+	size_t j, tries;
+	bool written = true;
+
+	for (tries = 0; ; tries++) {
+		hook_list_threads();
+		hook_suspend_threads();
+		if (hook_threads_clear(batch, count) == true) {
+			break;
+		}
+		hook_resume_threads();
+
+		// give whoever it was a moment to get out of there
+		if (tries == HOOK_SUSPEND_TRIES) {
+			return false;
+		}
+		#ifdef _WIN32
+			Sleep(1);
+		#else
+			usleep(1000);
+		#endif
+	}
+
+	for (j = 0; j < count; j++) {
+		if (remove == false) {
+			written = hook_write_code(batch[j].target, batch[j].original,
+			                          batch[j].jump);
+		} else {
+			written = hook_write_code(batch[j].target, batch[j].jump,
+			                          batch[j].original);
+		}
+		if (written == false) {
+			break;
+		}
+	}
+
+	// one of them changed under us, put back the ones already done
+	if (written == false) {
+		while (j-- > 0) {
+			if (remove == false) {
+				hook_write_code(batch[j].target, batch[j].jump,
+				                batch[j].original);
+			} else {
+				hook_write_code(batch[j].target, batch[j].original,
+				                batch[j].jump);
+			}
+		}
+	}
+
+	hook_resume_threads();
+	return written;
+}
+
+// Unprotects every target in a batch. Targets on the same page(s) as one
+// before them are skipped, finding out a page's protection can be slow.
+// Any others sharing a page have to be reprotected backwards, to end up
+// with the protection the first one found. must hold the lock
+static bool hook_unprotect_batch (hook_t* batch, size_t count,
+                                  unsigned long* oldProtect) {
+	unsigned char *first, *last;
+	size_t j, k;
+
+	for (j = 0; j < count; j++) {
+		first = hook_page(batch[j].target);
+		last = hook_page(batch[j].target + HOOK_JMP_SIZE-1);
+		for (k = 0; k < j; k++) {
+			if (hook_page(batch[k].target) == first
+			    && hook_page(batch[k].target + HOOK_JMP_SIZE-1) == last) {
+				break;
+			}
+		}
+		if (k < j) {
+			oldProtect[j*2] = HOOK_PROTECT_SHARED;
+			continue;
+		}
+
+		if (hook_unprotect(batch[j].target, &oldProtect[j*2]) == false) {
+			hook_reprotect_batch(batch, j, oldProtect);
+			return false;
+		}
+	}
+	return true;
+}
+
+bool hook_install (void* target, void* detour, void** bridge) {
+	hook_t hook;
+	hook_t* newHooks;
+	unsigned long oldProtect[2];
+	void* oldBridge;
+	bool written = false;
+
+	hook_enter();
+
+	// already hooked, this one goes in front
+	if (hook_find(target) != NULL) {
+		written = hook_chain_add(hook_find(target), detour, bridge);
+		hook_leave();
+		return written;
+	}
+
+	// make room first, so nothing can go wrong once the hook is in
+	newHooks = (hook_t*)realloc(hooks, sizeof(hook_t) * (numHooks+1));
+	if (newHooks == NULL) {
+		hook_leave();
+		return false;
+	}
+	hooks = newHooks;
+
+	if (hook_prepare(&hook, target, detour) == false) {
+		hook_leave();
+		return false;
+	}
+
+	// the detour can be called as soon as the JMP is in, so it needs
+	// to know where to go on to by then
+	oldBridge = *bridge;
+	*bridge = hook.bridge;
+
+	if (hook_unprotect(hook.target, oldProtect) == true) {
+		written = hook_write_code(hook.target, hook.original, hook.jump);
+		hook_reprotect(hook.target, oldProtect);
+	}
+	if (written == false) {
+		*bridge = oldBridge;
+		hook_discard(&hook);
+		hook_leave();
+		return false;
+	}
+
+	hooks[numHooks++] = hook;
+
+	hook_leave();
+	return true;
+}
+
+// Puts the function's bytes back and frees everything the hook made.
+// must hold the lock
+static bool hook_remove_locked (hook_t* hook) {
+	unsigned long oldProtect[2];
+	bool written;
+
+	if (hook_unprotect(hook->target, oldProtect) == false) {
+		return false;
+	}
+	written = hook_write_code(hook->target, hook->jump, hook->original);
+	hook_reprotect(hook->target, oldProtect);
+
+	// somebody hooked over us, pulling ours out would break theirs
+	if (written == false) {
+		return false;
+	}
+
+	hook_discard(hook);
+	*hook = hooks[--numHooks];
+	return true;
+}
+
+bool hook_remove (void* target) {
+	hook_t* hook;
+	bool removed = false;
+
+	hook_enter();
+	hook = hook_find(target);
+	if (hook != NULL) {
+		removed = hook_remove_locked(hook);
+	}
+	hook_leave();
+
+	return removed;
+}
+
+bool hook_remove_detour (void* target, void* detour) {
+	hook_t* hook;
+	size_t j;
+	bool removed;
+
+	hook_enter();
+
+	hook = hook_find(target);
+	if (hook == NULL) {
+		hook_leave();
+		return false;
+	}
+	for (j = 0; j < hook->numDetours; j++) {
+		if (hook->detours[j] == detour) {
+			break;
+		}
+	}
+	if (j == hook->numDetours) {
+		hook_leave();
+		return false;
+	}
+
+	// the last one, take the whole hook out (without letting go of the
+	// lock, or a detour added meanwhile would go with it)
+	if (hook->numDetours == 1) {
+		removed = hook_remove_locked(hook);
+		hook_leave();
+		return removed;
+	}
+
+	// Link around it. The entry it goes on through is left alone, and
+	// isn't used again, so anyone still in it gets where they were going.
+	if (hook->entries[j] != 0) {
+		hook->retired |= 1u << hook->entries[j];
+	}
+	hook->numDetours--;
+	memmove(&hook->detours[j], &hook->detours[j+1],
+	        sizeof(void*) * (hook->numDetours - j));
+	memmove(&hook->entries[j], &hook->entries[j+1], hook->numDetours - j);
+	hook_stub_link(hook);
+
+	// Only the first detour left, it can go back to being jumped to
+	// directly. (the stub stays around for anyone who's in it.)
+	if (hook->numDetours == 1 && hook->entries[0] == 0
+	    && hook_retarget(hook, hook->direct) == true) {
+		hook->viaStub = false;
+	}
+
+	hook_leave();
+	return true;
+}
+
+// what a failed hook_install_batch leaves its requests' bridges as
+static void hook_clear_bridges (hook_request_t* requests, size_t count) {
+	size_t j;
+
+	for (j = 0; j < count; j++) {
+		requests[j].bridge = NULL;
+	}
+}
+
+bool hook_install_batch (hook_request_t* requests, size_t count) {
+	hook_t* batch;
+	hook_t* newHooks;
+	unsigned long* oldProtect;
+	size_t j, k;
+	bool done = false;
+
+	hook_enter();
+
+	// make room for everything first
+	newHooks = (hook_t*)realloc(hooks, sizeof(hook_t) * (numHooks+count));
+	if (newHooks == NULL) {
+		hook_leave();
+		hook_clear_bridges(requests, count);
+		return false;
+	}
+	hooks = newHooks;
+
+	batch = (hook_t*)malloc(sizeof(hook_t) * count);
+	oldProtect = (unsigned long*)malloc(sizeof(unsigned long) * count*2);
+	if (batch == NULL || oldProtect == NULL) {
+		free(batch);
+		free(oldProtect);
+		hook_leave();
+		hook_clear_bridges(requests, count);
+		return false;
+	}
+
+	// build all the bridges while everyone's still running. No hooking
+	// anything twice, in the batch or otherwise.
+	for (j = 0; j < count; j++) {
+		for (k = 0; k < j; k++) {
+			if (requests[k].target == requests[j].target) {
+				break;
+			}
+		}
+		if (k < j || hook_find(requests[j].target) != NULL
+		    || hook_prepare(&batch[j], requests[j].target,
+		                    requests[j].detour) == false) {
+			break;
+		}
+	}
+
+	// the detours need their bridges by the time the JMPs are in
+	for (k = 0; k < j; k++) {
+		requests[k].bridge = batch[k].bridge;
+	}
+
+	if (j == count && hook_unprotect_batch(batch, count, oldProtect) == true) {
+		done = hook_patch_batch(batch, count, false);
+		hook_reprotect_batch(batch, count, oldProtect);
+	}
+
+	if (done == true) {
+		for (j = 0; j < count; j++) {
+			hooks[numHooks++] = batch[j];
+		}
+	} else {
+		// the bridges they were given are about to be gone
+		while (j-- > 0) {
+			hook_discard(&batch[j]);
+		}
+		hook_clear_bridges(requests, count);
+	}
+
+	free(batch);
+	free(oldProtect);
+	hook_leave();
+	return done;
+}
+
+bool hook_remove_batch (void** targets, size_t count) {
+	hook_t* batch;
+	hook_t* hook;
+	unsigned long* oldProtect;
+	size_t j, k;
+	bool done = false;
+
+	hook_enter();
+
+	batch = (hook_t*)malloc(sizeof(hook_t) * count);
+	oldProtect = (unsigned long*)malloc(sizeof(unsigned long) * count*2);
+	if (batch == NULL || oldProtect == NULL) {
+		free(batch);
+		free(oldProtect);
+		hook_leave();
+		return false;
+	}
+
+	for (j = 0; j < count; j++) {
+		for (k = 0; k < j; k++) {
+			if (targets[k] == targets[j]) {
+				break;
+			}
+		}
+		hook = hook_find(targets[j]);
+		if (k < j || hook == NULL) {
+			break;
+		}
+		batch[j] = *hook;
+	}
+
+	if (j == count && hook_unprotect_batch(batch, count, oldProtect) == true) {
+		done = hook_patch_batch(batch, count, true);
+		hook_reprotect_batch(batch, count, oldProtect);
+	}
+
+	if (done == true) {
+		for (j = 0; j < count; j++) {
+			hook = hook_find(batch[j].target);
+			hook_discard(hook);
+			*hook = hooks[--numHooks];
+		}
+	}
+
+	free(batch);
+	free(oldProtect);
+	hook_leave();
+	return done;
+}
\ No newline at end of file
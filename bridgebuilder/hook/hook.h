@@ -0,0 +1,161 @@
+/**
+ * hook.h
+ *
+ * Installing and removing hooks
+ *
+ * bridge_create only builds the bridge; the hook itself is a JMP written
+ * over the start of the hooked function, and other threads may well be
+ * running that function while the JMP is written. Copying the bytes in
+ * one at a time, some thread will sooner or later execute half of an
+ * old instruction and half of the JMP. These functions write the whole
+ * JMP with a single atomic store instead, so every thread sees either
+ * the old prologue or the hook and nothing in between, and the world
+ * doesn't have to be stopped to hook it.
+ *
+ * When the 5 bytes of the JMP are all inside one aligned 8-byte word,
+ * that word is swapped in with one compare-and-exchange. Otherwise, the
+ * first 2 bytes are swapped for a JMP to itself, which any thread coming
+ * in spins on while the other 3 are written, and then swapped for the
+ * first 2 bytes of the hook's JMP.
+ *
+ * Threads that are already past the start of the function when it gets
+ * hooked, or that have fetched the first instruction but not yet run
+ * it, are not protected by this. They may still run into the middle of
+ * the JMP. The batch functions take care of those too: they stop every
+ * other thread once for the whole batch, and only patch once none of
+ * them is stopped in the middle of anything being patched. On Linux,
+ * threads are found in /proc/self/task and stopped with a signal,
+ * HOOK_SUSPEND_SIGNAL (SIGRTMIN+5 unless defined otherwise), which the
+ * program must leave alone.
+ *
+ * A function can have more than one detour. The first one is jumped to
+ * directly; once there are more, the function jumps to a small dispatch
+ * stub near it instead, whose entries are indirect jumps through
+ * pointers. Each detour calls on through its own entry, so a detour is
+ * added to or taken out of the chain by storing a pointer or two, and
+ * threads already somewhere in the chain carry on where they were going.
+ *
+ **/
+
+#pragma once
+#include <stddef.h> // size_t
+
+/**
+ * hook_request_t
+ *
+ * One function to hook, for hook_install_batch.
+ */
+struct hook_request_t {
+	void* target;
+	void* detour;
+	// receives the bridge to the original function
+	void* bridge;
+};
+
+/**
+ * hook_install
+ *
+ * Hooks a function, so calls to it go to detour instead. A bridge to
+ * the original function is created first, for the detour to call it
+ * through, and then the start of the function is atomically replaced
+ * with a JMP to the detour.
+ *
+ * In 64-bit code, a detour more than 2GB away from the function is
+ * reached through a small relay near the function that does the
+ * absolute jump.
+ *
+ * If the function is already hooked with hook_install, the detour goes
+ * in front of the ones it already has (up to HOOK_MAX_DETOURS of them),
+ * and *bridge receives the way on to the next one rather than the
+ * bridge itself.
+ *
+ * @param target  The function to hook. It must not already be hooked by
+ *                anyone else.
+ * @param detour  Where calls to target should go instead.
+ * @param bridge  Receives what the detour should call to go on to the
+ *                original function, before the hook is written.
+ *
+ * @return  true if the function was hooked. On failure, nothing about
+ *          the function has changed and *bridge is not touched.
+ */
+bool hook_install (void* target, void* detour, void** bridge);
+
+/**
+ * hook_remove
+ *
+ * Unhooks a function hooked with hook_install, atomically putting the
+ * original bytes back, and then destroys its bridge.
+ *
+ * The bridge (and relay, if there is one) is freed as soon as the hook
+ * is gone, so it's up to the caller to make sure no thread is still in
+ * the detour or on its way into it, and could still call into the
+ * bridge, by then.
+ *
+ * @param target  The hooked function.
+ *
+ * @return  true if the hook was removed. false if the function isn't
+ *          hooked, or if the JMP has since been overwritten by someone
+ *          else, in which case it is left alone.
+ */
+bool hook_remove (void* target);
+
+/**
+ * hook_remove_detour
+ *
+ * Takes one detour out of a function's chain, leaving the others. Its
+ * way on down the chain is left where it was, so a thread still in the
+ * detour goes on fine, and isn't freed or given to another detour until
+ * the whole hook is removed. So a function can only ever be given
+ * HOOK_MAX_DETOURS detours in front of its first one, counting the
+ * ones taken out again, before hook_install fails on it until it's
+ * been unhooked. If it was the only detour, this is the same as
+ * hook_remove.
+ *
+ * @param target  The hooked function.
+ * @param detour  The detour to take out.
+ *
+ * @return  true if the detour was taken out. false if the function
+ *          isn't hooked or doesn't have that detour.
+ */
+bool hook_remove_detour (void* target, void* detour);
+
+/**
+ * hook_install_batch
+ *
+ * Hooks a whole set of functions at once, like calling hook_install on
+ * each, but with every other thread stopped only once for all of them.
+ * All the bridges are built first, while everything is still running,
+ * and then every JMP is written in one go.
+ *
+ * If a thread is stopped in the middle of a prologue that's about to be
+ * overwritten, it's let go and given a moment to get out of there
+ * before trying again.
+ *
+ * Unlike hook_install, none of the functions may already be hooked.
+ *
+ * @param requests  The functions to hook and their detours. Each one's
+ *                  bridge field receives its bridge, before the hooks
+ *                  are written.
+ * @param count     How many requests there are.
+ *
+ * @return  true if every function was hooked. Otherwise none of them
+ *          were, and every request's bridge field is set to NULL (the
+ *          bridges the detours may already have been given are gone).
+ */
+bool hook_install_batch (hook_request_t* requests, size_t count);
+
+/**
+ * hook_remove_batch
+ *
+ * Unhooks a set of functions hooked with hook_install or
+ * hook_install_batch at once, with every other thread stopped only once
+ * for all of them. The same care about threads still in the detours
+ * needs to be taken as with hook_remove.
+ *
+ * @param targets  The hooked functions.
+ * @param count    How many there are.
+ *
+ * @return  true if every function was unhooked. Otherwise none of them
+ *          were.
+ */
+bool hook_remove_batch (void** targets, size_t count);
\ No newline at end of file
@@ -0,0 +1,634 @@
+#include "probe.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hook.h"
+#include "../bridgebuilder.h"
+#include "../mem/codepool.h"
+#ifdef _WIN32
+ #define WIN32_LEAN_AND_MEAN
+ #include <Windows.h>
+ #include <intrin.h>
+#else
+ #include <pthread.h>
+ #include <x86intrin.h>
+#endif
+
+// Each shard is a cache line of its own.
+#define PROBE_LINE       64
+#define PROBE_LINE_SHIFT 6
+
+// The most timed calls a thread can be in at once. Any deeper, and calls
+// just aren't timed until it's back out of some of them.
+#define PROBE_MAX_DEPTH 32
+
+// Plenty for the biggest stub, a 64-bit one that times calls.
+#define PROBE_STUB_MAX 256
+
+#ifdef _WIN32
+ #define PROBE_THREAD __declspec(thread)
+ #define PROBE_ADD(var, n) \
+	InterlockedExchangeAdd64((LONGLONG volatile*)&(var), (LONGLONG)(n))
+#else
+ #define PROBE_THREAD __thread
+ #define PROBE_ADD(var, n) \
+	__atomic_fetch_add(&(var), (unsigned long long)(n), __ATOMIC_RELAXED)
+#endif
+
+// The generated code calls into these with the platform's own calling
+// convention, which in 32-bit code is cdecl (and GCC may expect the stack
+// to be more aligned than it is when we get there).
+#if X86_MODE_NATIVE == X86_MODE_64
+ #define PROBE_HELPER
+#elif defined(_MSC_VER)
+ #define PROBE_HELPER __cdecl
+#else
+ #define PROBE_HELPER __attribute__((cdecl, force_align_arg_pointer))
+#endif
+
+struct probeshard_t {
+	// In 32-bit code this is added to as two halves, the carry going
+	// into the top one after the bottom one has wrapped around.
+	unsigned long long volatile calls;
+	unsigned char unused[PROBE_LINE - sizeof(unsigned long long)];
+};
+
+// Lives in ordinary memory, where the stub can write to it.
+struct probe_t {
+	probeshard_t shards[PROBE_SHARDS];
+
+	// where the stub goes on to, filled in by hook_install
+	void* volatile next;
+
+	unsigned long long volatile samples;
+	unsigned long long volatile ticks;
+
+	void* target;
+	unsigned char* stub;
+	// what was malloc'd, probe_t itself is aligned to a cache line
+	void* memory;
+};
+
+// A timed call on its way out: where its return address was, what it
+// was, and when it was made.
+struct probeframe_t {
+	void** slot;
+	void* returnAddress;
+	probe_t* probe;
+	unsigned long long start;
+};
+
+static probe_t** probes = NULL;
+static size_t numProbes = 0;
+
+// Where every timed call returns to. Made the first time it's needed,
+// and then kept for good, there may always be a call out there still to
+// come back through it.
+static unsigned char* exitThunk = NULL;
+
+static PROBE_THREAD probeframe_t frames[PROBE_MAX_DEPTH];
+static PROBE_THREAD size_t numFrames = 0;
+
+#ifdef _WIN32
+ static SRWLOCK probeLock = SRWLOCK_INIT;
+#else
+ static pthread_mutex_t probeLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+__inline void probe_enter (void) {
+	#ifdef _WIN32
+		AcquireSRWLockExclusive(&probeLock);
+	#else
+		pthread_mutex_lock(&probeLock);
+	#endif
+}
+
+__inline void probe_leave (void) {
+	#ifdef _WIN32
+		ReleaseSRWLockExclusive(&probeLock);
+	#else
+		pthread_mutex_unlock(&probeLock);
+	#endif
+}
+
+// reads a counter in one piece, even in 32-bit code
+static __inline unsigned long long probe_load (
+                                  unsigned long long volatile* counter) {
+	#ifdef _WIN32
+		return (unsigned long long)InterlockedCompareExchange64(
+		                                 (LONGLONG volatile*)counter, 0, 0);
+	#else
+		return __atomic_load_n(counter, __ATOMIC_RELAXED);
+	#endif
+}
+
+// must hold the lock
+static probe_t* probe_find (void* target) {
+	size_t j;
+
+	for (j = 0; j < numProbes; j++) {
+		if (probes[j]->target == target) {
+			return probes[j];
+		}
+	}
+	return NULL;
+}
+
+// Called from a stub, on a call to be timed, with where its return
+// address is. The return address is swapped for the exit thunk's, unless
+// this thread has too many timed calls going already.
+static void PROBE_HELPER probe_sample_enter (probe_t* probe, void** slot) {
+	probeframe_t* frame;
+
+	// A timed call that jumped here (a tail call) already swapped its
+	// return address for the exit thunk's, and the frame for this slot
+	// is its. It comes back only once, so this call is just counted.
+	if (*slot == exitThunk) {
+		return;
+	}
+
+	// Calls still waiting to return are further up the stack than this
+	// one. Any that aren't were left with a longjmp.
+	while (numFrames > 0 && frames[numFrames-1].slot <= slot) {
+		numFrames--;
+	}
+
+	if (numFrames == PROBE_MAX_DEPTH) {
+		return;
+	}
+
+	// taken before it's filled in, so a signal handler making a timed
+	// call of its own in the meantime gets the next one
+	frame = &frames[numFrames++];
+	frame->slot = slot;
+	frame->returnAddress = *slot;
+	frame->probe = probe;
+	*slot = exitThunk;
+
+	frame->start = __rdtsc();
+}
+
+// Called from the exit thunk when a timed call returns, with where its
+// return address was. Returns where it should have returned to.
+static void* PROBE_HELPER probe_sample_exit (void** slot) {
+	unsigned long long end = __rdtsc();
+	probeframe_t frame;
+	size_t j;
+
+	// Normally this is the newest frame. If it isn't, the ones after it
+	// were for calls that were left with a longjmp, and never will
+	// return either.
+	for (j = numFrames; j-- > 0; ) {
+		if (frames[j].slot == slot) {
+			break;
+		}
+	}
+	if (j == (size_t)-1) {
+		// there's nowhere to go back to
+		fprintf(stderr, "probe: timed call returned on another stack\n");
+		abort();
+	}
+
+	frame = frames[j];
+	numFrames = j;
+
+	PROBE_ADD(frame.probe->samples, 1);
+	PROBE_ADD(frame.probe->ticks, end - frame.start);
+
+	return frame.returnAddress;
+}
+
+// appends some code to a stub being written
+static __inline unsigned char* probe_put (unsigned char* out,
+                                          const void* code, size_t size) {
+	memcpy(out, code, size);
+	return out + size;
+}
+
+#if X86_MODE_NATIVE == X86_MODE_64
+
+// Puts the JMP on to probe->next (through R10, which is free to use on
+// the way into a function in both 64-bit calling conventions).
+static unsigned char* probe_put_next (unsigned char* out, probe_t* probe) {
+	static const unsigned char movR10[] = { 0x49, 0xBA };
+	static const unsigned char jmpR10[] = { 0x41, 0xFF, 0x22 };
+	void* volatile* next = &probe->next;
+
+	out = probe_put(out, movR10, sizeof(movR10));
+	out = probe_put(out, &next, sizeof(next));
+	return probe_put(out, jmpR10, sizeof(jmpR10));
+}
+
+// Writes the stub for a probe, returning how long it is. Only R10, R11
+// and the flags are touched on the way through, none of which the
+// function can be expecting anything in.
+static size_t probe_write_stub (unsigned char* out, probe_t* probe,
+                                unsigned int sampleMask) {
+	// The shard is picked by mixing a few runs of bits from the stack
+	// pointer's page number, so that threads' stacks end up in different
+	// ones however far apart they're spaced.
+	static const unsigned char shard[] = {
+		0x49, 0x89, 0xE3,                  // MOV R11,RSP
+		0x49, 0xC1, 0xEB, 0x0C,            // SHR R11,12
+		0x4D, 0x89, 0xDA,                  // MOV R10,R11
+		0x49, 0xC1, 0xEA, 0x06,            // SHR R10,6
+		0x4D, 0x31, 0xD3,                  // XOR R11,R10
+		0x49, 0xC1, 0xEA, 0x06,            // SHR R10,6
+		0x4D, 0x31, 0xD3,                  // XOR R11,R10
+		0x41, 0x83, 0xE3, PROBE_SHARDS-1,  // AND R11D,PROBE_SHARDS-1
+		0x49, 0xC1, 0xE3, PROBE_LINE_SHIFT,// SHL R11,PROBE_LINE_SHIFT
+		0x49, 0xBA                         // MOV R10,probe->shards
+	};
+	static const unsigned char count[] = {
+		0x4D, 0x01, 0xDA,                  // ADD R10,R11
+		0x41, 0xBB, 0x01, 0, 0, 0,         // MOV R11D,1
+		0xF0, 0x4D, 0x0F, 0xC1, 0x1A       // LOCK XADD [R10],R11
+	};
+	// TEST R11,sampleMask, and then a JZ rel8 over the JMP on
+	static const unsigned char test[] = { 0x49, 0xF7, 0xC3 };
+	static const unsigned char jz[] = { 0x74, 13 };
+
+	// For a timed call, everything an argument can be passed in is
+	// saved, probe_sample_enter is called with the probe and where the
+	// return address is, and then it's on as usual. The stack is 16-byte
+	// aligned again at the CALL.
+	#ifdef _WIN32
+		static const unsigned char save[] = {
+			0x51, 0x52, 0x41, 0x50, 0x41, 0x51    // PUSH RCX,RDX,R8,R9
+		};
+		static const unsigned char restore[] = {
+			0x41, 0x59, 0x41, 0x58, 0x5A, 0x59    // POP R9,R8,RDX,RCX
+		};
+		static const int numPushes = 4, numXmm = 4, xmmOffset = 32;
+		static const unsigned char movArg1[] = { 0x48, 0xB9 };
+		static const unsigned char leaArg2[] = { 0x48, 0x8D, 0x94, 0x24 };
+	#else
+		static const unsigned char save[] = {
+			0x57, 0x56, 0x52, 0x51,               // PUSH RDI,RSI,RDX,RCX
+			0x41, 0x50, 0x41, 0x51, 0x50          // PUSH R8,R9,RAX
+		};
+		static const unsigned char restore[] = {
+			0x58, 0x41, 0x59, 0x41, 0x58,         // POP RAX,R9,R8
+			0x59, 0x5A, 0x5E, 0x5F                // POP RCX,RDX,RSI,RDI
+		};
+		static const int numPushes = 7, numXmm = 8, xmmOffset = 0;
+		static const unsigned char movArg1[] = { 0x48, 0xBF };
+		static const unsigned char leaArg2[] = { 0x48, 0x8D, 0xB4, 0x24 };
+	#endif
+	static const unsigned char subRsp[] = { 0x48, 0x81, 0xEC };
+	static const unsigned char addRsp[] = { 0x48, 0x81, 0xC4 };
+	static const unsigned char movRax[] = { 0x48, 0xB8 };
+	static const unsigned char callRax[] = { 0xFF, 0xD0 };
+
+	void* shards = probe->shards;
+	void* enter = (void*)probe_sample_enter;
+	unsigned char* start = out;
+	int frameSize, slotOffset, j;
+
+	out = probe_put(out, shard, sizeof(shard));
+	out = probe_put(out, &shards, sizeof(shards));
+	out = probe_put(out, count, sizeof(count));
+
+	if (sampleMask == (unsigned int)-1) {
+		return probe_put_next(out, probe) - start;
+	}
+
+	out = probe_put(out, test, sizeof(test));
+	out = probe_put(out, &sampleMask, sizeof(sampleMask));
+	out = probe_put(out, jz, sizeof(jz));
+	out = probe_put_next(out, probe);
+
+	// room for the XMM registers, and for Windows, the CALL's shadow
+	// space, rounded so the pushes and all come to a multiple of 16 on
+	// top of the return address
+	frameSize = xmmOffset + numXmm*16;
+	if ((numPushes*8 + frameSize) % 16 == 0) {
+		frameSize += 8;
+	}
+	slotOffset = frameSize + numPushes*8;
+
+	out = probe_put(out, save, sizeof(save));
+	out = probe_put(out, subRsp, sizeof(subRsp));
+	out = probe_put(out, &frameSize, sizeof(frameSize));
+	for (j = 0; j < numXmm; j++) {
+		// MOVDQU [RSP+disp8],XMMj
+		*out++ = 0xF3; *out++ = 0x0F; *out++ = 0x7F;
+		*out++ = (unsigned char)(0x44 | (j << 3)); *out++ = 0x24;
+		*out++ = (unsigned char)(xmmOffset + j*16);
+	}
+
+	out = probe_put(out, movArg1, sizeof(movArg1));
+	out = probe_put(out, &probe, sizeof(probe));
+	out = probe_put(out, leaArg2, sizeof(leaArg2));
+	out = probe_put(out, &slotOffset, sizeof(slotOffset));
+	out = probe_put(out, movRax, sizeof(movRax));
+	out = probe_put(out, &enter, sizeof(enter));
+	out = probe_put(out, callRax, sizeof(callRax));
+
+	for (j = 0; j < numXmm; j++) {
+		// MOVDQU XMMj,[RSP+disp8]
+		*out++ = 0xF3; *out++ = 0x0F; *out++ = 0x6F;
+		*out++ = (unsigned char)(0x44 | (j << 3)); *out++ = 0x24;
+		*out++ = (unsigned char)(xmmOffset + j*16);
+	}
+	out = probe_put(out, addRsp, sizeof(addRsp));
+	out = probe_put(out, &frameSize, sizeof(frameSize));
+	out = probe_put(out, restore, sizeof(restore));
+
+	return probe_put_next(out, probe) - start;
+}
+
+// Writes the code timed calls return through. It saves whatever the
+// function returned in, asks probe_sample_exit where the call was really
+// going back to, and goes there.
+static size_t probe_write_exit (unsigned char* out) {
+	#ifdef _WIN32
+		static const unsigned char saveCall[] = {
+			0x50,                              // PUSH RAX
+			0x48, 0x83, 0xEC, 0x38,            // SUB RSP,56
+			0xF3, 0x0F, 0x7F, 0x44, 0x24, 0x20,// MOVDQU [RSP+32],XMM0
+			0x48, 0x8D, 0x4C, 0x24, 0x38,      // LEA RCX,[RSP+56]
+			0x48, 0xB8                         // MOV RAX,probe_sample_exit
+		};
+		static const unsigned char restore[] = {
+			0xFF, 0xD0,                        // CALL RAX
+			0x49, 0x89, 0xC3,                  // MOV R11,RAX
+			0xF3, 0x0F, 0x6F, 0x44, 0x24, 0x20,// MOVDQU XMM0,[RSP+32]
+			0x48, 0x83, 0xC4, 0x38,            // ADD RSP,56
+			0x58,                              // POP RAX
+			0x41, 0xFF, 0xE3                   // JMP R11
+		};
+	#else
+		static const unsigned char saveCall[] = {
+			0x50, 0x52,                        // PUSH RAX,RDX
+			0x48, 0x83, 0xEC, 0x20,            // SUB RSP,32
+			0xF3, 0x0F, 0x7F, 0x04, 0x24,      // MOVDQU [RSP],XMM0
+			0xF3, 0x0F, 0x7F, 0x4C, 0x24, 0x10,// MOVDQU [RSP+16],XMM1
+			0x48, 0x8D, 0x7C, 0x24, 0x28,      // LEA RDI,[RSP+40]
+			0x48, 0xB8                         // MOV RAX,probe_sample_exit
+		};
+		static const unsigned char restore[] = {
+			0xFF, 0xD0,                        // CALL RAX
+			0x49, 0x89, 0xC3,                  // MOV R11,RAX
+			0xF3, 0x0F, 0x6F, 0x04, 0x24,      // MOVDQU XMM0,[RSP]
+			0xF3, 0x0F, 0x6F, 0x4C, 0x24, 0x10,// MOVDQU XMM1,[RSP+16]
+			0x48, 0x83, 0xC4, 0x20,            // ADD RSP,32
+			0x5A, 0x58,                        // POP RDX,RAX
+			0x41, 0xFF, 0xE3                   // JMP R11
+		};
+	#endif
+	void* exit = (void*)probe_sample_exit;
+	unsigned char* start = out;
+
+	out = probe_put(out, saveCall, sizeof(saveCall));
+	out = probe_put(out, &exit, sizeof(exit));
+	return probe_put(out, restore, sizeof(restore)) - start;
+}
+
+#else
+
+// JMP [probe->next]
+static unsigned char* probe_put_next (unsigned char* out, probe_t* probe) {
+	static const unsigned char jmpAbs[] = { 0xFF, 0x25 };
+	void* volatile* next = &probe->next;
+
+	out = probe_put(out, jmpAbs, sizeof(jmpAbs));
+	return probe_put(out, &next, sizeof(next));
+}
+
+// Writes the stub for a probe, returning how long it is. There are no
+// registers to spare in 32-bit code (any of them could be carrying an
+// argument), so EAX and ECX are saved around the counting.
+static size_t probe_write_stub (unsigned char* out, probe_t* probe,
+                                unsigned int sampleMask) {
+	// the shard, picked the same way as in 64-bit code
+	static const unsigned char shard[] = {
+		0x50, 0x51,                        // PUSH EAX,ECX
+		0x89, 0xE0,                        // MOV EAX,ESP
+		0xC1, 0xE8, 0x0C,                  // SHR EAX,12
+		0x89, 0xC1,                        // MOV ECX,EAX
+		0xC1, 0xE9, 0x06,                  // SHR ECX,6
+		0x31, 0xC8,                        // XOR EAX,ECX
+		0xC1, 0xE9, 0x06,                  // SHR ECX,6
+		0x31, 0xC8,                        // XOR EAX,ECX
+		0x83, 0xE0, PROBE_SHARDS-1,        // AND EAX,PROBE_SHARDS-1
+		0xC1, 0xE0, PROBE_LINE_SHIFT,      // SHL EAX,PROBE_LINE_SHIFT
+		0x05                               // ADD EAX,probe->shards
+	};
+	static const unsigned char count[] = {
+		0xB9, 0x01, 0, 0, 0,               // MOV ECX,1
+		0xF0, 0x0F, 0xC1, 0x08,            // LOCK XADD [EAX],ECX
+		0xF0, 0x83, 0x50, 0x04, 0x00       // LOCK ADC DWORD [EAX+4],0
+	};
+	// TEST ECX,sampleMask, then the pops (which leave the flags alone)
+	// and a JZ rel8 over the JMP on
+	static const unsigned char test[] = { 0xF7, 0xC1 };
+	static const unsigned char restore[] = { 0x59, 0x58 };
+	static const unsigned char jz[] = { 0x74, 6 };
+
+	// everything is saved for a timed call, and probe_sample_enter is
+	// called with the probe and where the return address is
+	static const unsigned char saveAll[] = {
+		0x60,                              // PUSHAD
+		0x8D, 0x44, 0x24, 0x20,            // LEA EAX,[ESP+32]
+		0x50,                              // PUSH EAX
+		0x68                               // PUSH probe
+	};
+	static const unsigned char callEnter[] = {
+		0xFF, 0xD0,                        // CALL EAX
+		0x83, 0xC4, 0x08,                  // ADD ESP,8
+		0x61                               // POPAD
+	};
+	static const unsigned char movEax[] = { 0xB8 };
+
+	void* shards = probe->shards;
+	void* enter = (void*)probe_sample_enter;
+	unsigned char* start = out;
+
+	out = probe_put(out, shard, sizeof(shard));
+	out = probe_put(out, &shards, sizeof(shards));
+	out = probe_put(out, count, sizeof(count));
+
+	if (sampleMask == (unsigned int)-1) {
+		out = probe_put(out, restore, sizeof(restore));
+		return probe_put_next(out, probe) - start;
+	}
+
+	out = probe_put(out, test, sizeof(test));
+	out = probe_put(out, &sampleMask, sizeof(sampleMask));
+	out = probe_put(out, restore, sizeof(restore));
+	out = probe_put(out, jz, sizeof(jz));
+	out = probe_put_next(out, probe);
+
+	out = probe_put(out, saveAll, sizeof(saveAll));
+	out = probe_put(out, &probe, sizeof(probe));
+	out = probe_put(out, movEax, sizeof(movEax));
+	out = probe_put(out, &enter, sizeof(enter));
+	out = probe_put(out, callEnter, sizeof(callEnter));
+
+	return probe_put_next(out, probe) - start;
+}
+
+// Writes the code timed calls return through, keeping EDX:EAX (and ST0,
+// which nothing here touches) as the function left them.
+static size_t probe_write_exit (unsigned char* out) {
+	static const unsigned char saveCall[] = {
+		0x50, 0x52,                        // PUSH EAX,EDX
+		0x8D, 0x4C, 0x24, 0x04,            // LEA ECX,[ESP+4]
+		0x51,                              // PUSH ECX
+		0xB8                               // MOV EAX,probe_sample_exit
+	};
+	static const unsigned char restore[] = {
+		0xFF, 0xD0,                        // CALL EAX
+		0x83, 0xC4, 0x04,                  // ADD ESP,4
+		0x89, 0xC1,                        // MOV ECX,EAX
+		0x5A, 0x58,                        // POP EDX,EAX
+		0xFF, 0xE1                         // JMP ECX
+	};
+	void* exit = (void*)probe_sample_exit;
+	unsigned char* start = out;
+
+	out = probe_put(out, saveCall, sizeof(saveCall));
+	out = probe_put(out, &exit, sizeof(exit));
+	return probe_put(out, restore, sizeof(restore)) - start;
+}
+
+#endif
+
+// Makes the exit thunk, if it hasn't been already. must hold the lock
+static bool probe_make_exit (void) {
+	unsigned char code[PROBE_STUB_MAX];
+	unsigned char* write;
+	size_t size;
+
+	if (exitThunk != NULL) {
+		return true;
+	}
+
+	size = probe_write_exit(code);
+	exitThunk = (unsigned char*)codepool_alloc(size, NULL, (void**)&write);
+	if (exitThunk == NULL) {
+		return false;
+	}
+	codepool_unlock(exitThunk);
+	memcpy(write, code, size);
+	codepool_lock(exitThunk);
+
+	return true;
+}
+
+// frees a probe that isn't hooked in (anymore)
+static void probe_free (probe_t* probe) {
+	codepool_free(probe->stub);
+	free(probe->memory);
+}
+
+bool probe_install (void* target, unsigned int sampleEvery) {
+	unsigned char code[PROBE_STUB_MAX];
+	unsigned char* stubWrite;
+	unsigned int sampleMask;
+	probe_t** newProbes;
+	probe_t* probe;
+	void* memory;
+	size_t size;
+
+	probe_enter();
+
+	if (probe_find(target) != NULL
+	    || (sampleEvery > 0 && probe_make_exit() == false)) {
+		probe_leave();
+		return false;
+	}
+
+	newProbes = (probe_t**)realloc(probes, sizeof(probe_t*) * (numProbes+1));
+	if (newProbes == NULL) {
+		probe_leave();
+		return false;
+	}
+	probes = newProbes;
+
+	memory = malloc(sizeof(probe_t) + PROBE_LINE-1);
+	if (memory == NULL) {
+		probe_leave();
+		return false;
+	}
+	probe = (probe_t*)((size_t(memory) + PROBE_LINE-1) & ~size_t(PROBE_LINE-1));
+	memset(probe, 0, sizeof(probe_t));
+	probe->target = target;
+	probe->memory = memory;
+
+	// The stub writers take all ones for not timing anything, which no
+	// real mask is, they're never more than 31 bits.
+	sampleMask = (unsigned int)-1;
+	if (sampleEvery > 0) {
+		for (sampleMask = 1; sampleMask < sampleEvery
+		                     && sampleMask < 0x80000000; sampleMask <<= 1);
+		sampleMask--;
+	}
+
+	size = probe_write_stub(code, probe, sampleMask);
+	probe->stub = (unsigned char*)codepool_alloc(size, target,
+	                                             (void**)&stubWrite);
+	if (probe->stub == NULL) {
+		free(memory);
+		probe_leave();
+		return false;
+	}
+	codepool_unlock(probe->stub);
+	memcpy(stubWrite, code, size);
+	codepool_lock(probe->stub);
+
+	if (hook_install(target, probe->stub, (void**)&probe->next) == false) {
+		probe_free(probe);
+		probe_leave();
+		return false;
+	}
+
+	probes[numProbes++] = probe;
+
+	probe_leave();
+	return true;
+}
+
+bool probe_remove (void* target) {
+	probe_t* probe;
+	size_t j;
+
+	probe_enter();
+
+	probe = probe_find(target);
+	if (probe == NULL || hook_remove_detour(target, probe->stub) == false) {
+		probe_leave();
+		return false;
+	}
+
+	for (j = 0; probes[j] != probe; j++);
+	probes[j] = probes[--numProbes];
+	probe_free(probe);
+
+	probe_leave();
+	return true;
+}
+
+bool probe_read (void* target, probe_counts_t* counts) {
+	probe_t* probe;
+	size_t j;
+
+	probe_enter();
+
+	probe = probe_find(target);
+	if (probe == NULL) {
+		probe_leave();
+		return false;
+	}
+
+	counts->calls = 0;
+	for (j = 0; j < PROBE_SHARDS; j++) {
+		counts->calls += probe_load(&probe->shards[j].calls);
+	}
+	counts->samples = probe_load(&probe->samples);
+	counts->ticks = probe_load(&probe->ticks);
+
+	probe_leave();
+	return true;
+}
\ No newline at end of file
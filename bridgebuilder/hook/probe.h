@@ -0,0 +1,106 @@
+/**
+ * probe.h
+ *
+ * Counting calls to functions without writing a detour for them
+ *
+ * Most hooks are only there to measure something: how often a function
+ * is called, and how long it takes. A probe does that for a function
+ * with a detour generated into the code pool, so it costs a few
+ * instructions per call rather than a call into C++ and back.
+ *
+ * The generated detour adds one to a call counter and jumps on to the
+ * bridge (or the next detour, probes are hooked in with hook_install
+ * like any other detour). The counters themselves are kept outside the
+ * code pool, in ordinary memory, since code pool memory can't be written
+ * from the code in it. There are PROBE_SHARDS of them per function, each
+ * on its own cache line, and threads pick one by where their stack is,
+ * so threads calling the same function at the same time mostly aren't
+ * fighting over one counter.
+ *
+ * A probe can also time every Nth call. For those calls, the return
+ * address is swapped for a small piece of code that reads the time stamp
+ * counter again on the way out before going back where the function was
+ * called from, so the function's own code runs untouched. That means the
+ * function can't be one that's unwound through by C++ exceptions (or
+ * Windows structured exceptions): the unwinder wouldn't recognize the
+ * return address. Leaving a timed call with longjmp is fine. Timed
+ * calls can't be made on any stack but the thread's own, though: not
+ * from fibers or coroutines with stacks of their own, nor from signal
+ * handlers running on an alternate stack.
+ *
+ **/
+
+#pragma once
+#include <stddef.h> // size_t
+
+/**
+ * PROBE_SHARDS
+ *
+ * How many counters each probe keeps its calls in. A power of two.
+ */
+#define PROBE_SHARDS 64
+
+/**
+ * probe_counts_t
+ *
+ * What a probe has counted so far, for probe_read.
+ */
+struct probe_counts_t {
+	// calls to the function
+	unsigned long long calls;
+	// how many of them were timed, and the time stamp counter ticks they
+	// took between them
+	unsigned long long samples;
+	unsigned long long ticks;
+};
+
+/**
+ * probe_install
+ *
+ * Starts counting calls to a function, by hooking it with a generated
+ * detour. The function can already be hooked with hook_install; the
+ * probe then goes in front of the detours it has, and counts the calls
+ * that reach them.
+ *
+ * @param target       The function to count calls to.
+ * @param sampleEvery  How often to time a call: every sampleEvery'th
+ *                     call is timed, rounded up to a power of two and
+ *                     counted separately for each shard. 0 to only count
+ *                     calls, which is the cheapest, and is the only safe
+ *                     choice for functions exceptions may go through.
+ *                     A call that another timed call jumped to on its
+ *                     way out (a tail call) is counted but not timed,
+ *                     its time goes to the one that jumped.
+ *
+ * @return  true if the function is being counted. false if it couldn't
+ *          be hooked, or already has a probe.
+ */
+bool probe_install (void* target, unsigned int sampleEvery);
+
+/**
+ * probe_remove
+ *
+ * Stops counting calls to a function, taking its probe out of its hooks
+ * and forgetting its counts. The same care about threads that may still
+ * be in the probe's detour needs to be taken as with hook_remove, and
+ * that includes any timed calls still to return.
+ *
+ * @param target  The function with the probe.
+ *
+ * @return  true if the probe was taken out.
+ */
+bool probe_remove (void* target);
+
+/**
+ * probe_read
+ *
+ * Adds up a probe's counters. This doesn't stop the calls being counted,
+ * so with threads calling the function at the same time, the counts are
+ * only a snapshot of a moving target.
+ *
+ * @param target  The function with the probe.
+ * @param counts  Receives the counts.
+ *
+ * @return  true if the function has a probe.
+ */
+bool probe_read (void* target, probe_counts_t* counts);
\ No newline at end of file
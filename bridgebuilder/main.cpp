@@ -1,13 +1,17 @@
 #include <Windows.h>
 #include <DbgHelp.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "bridgebuilder.h"
+#include "hook/hook.h"
+#include "hook/probe.h"
 
 #define TEST_MINIMUM_BYTES_DECODED 15
 
-bool run_opcode_test (const char* testName, void* codePtr, int desiredResult) {
-	int result = x86_instruction_length(codePtr,false);
+bool run_opcode_test (const char* testName, int mode, void* codePtr,
+                      int desiredResult) {
+	int result = x86_instruction_length(codePtr,mode,false);
 
 	printf("%17s  %d %s= %d\n", 
 	       testName, result, (result==desiredResult?"=":"!"), desiredResult);
@@ -15,25 +19,65 @@ bool run_opcode_test (const char* testName, void* codePtr, int desiredResult) {
 	return result == desiredResult;
 }
 
-bool run_import_test (const char* importName, void* fxnPtr) {
-	unsigned char* codePtr = (unsigned char*)fxnPtr;
+bool run_boundary_test (const char* testName, const char* code,
+                        size_t codeLength, const unsigned short* desired,
+                        size_t desiredCount) {
+	unsigned short offsets[32];
+	size_t count, j;
 
-	int j;
+	count = x86_decode_boundaries(code, codeLength, X86_MODE_32, offsets, 32);
 
-	while ((unsigned long)codePtr < (unsigned long)fxnPtr + TEST_MINIMUM_BYTES_DECODED) {
-		j = x86_instruction_length(codePtr,false);
-		if (j <= 0) {
-			printf("Failure!");
+	printf("%17s  %d %s= %d boundaries\n", testName, count,
+	       (count==desiredCount?"=":"!"), desiredCount);
+
+	if (count != desiredCount) {
+		return false;
+	}
+	for (j = 0; j < count; j++) {
+		if (offsets[j] != desired[j]) {
+			printf("%17s  boundary %d at %d, expected %d\n", "",
+			       j, offsets[j], desired[j]);
 			return false;
 		}
-		//printf("%08X: %d\n", codePtr, j);
+	}
+	return true;
+}
 
-		codePtr = &codePtr[j];
+bool run_import_test (const char* importName, void* fxnPtr) {
+	unsigned short offsets[TEST_MINIMUM_BYTES_DECODED+1];
+	size_t count;
+
+	// every instruction is at least a byte, so this always has room to
+	// get past TEST_MINIMUM_BYTES_DECODED, even if the last instruction
+	// is a long one.
+	count = x86_decode_boundaries(fxnPtr, 
+	                              TEST_MINIMUM_BYTES_DECODED
+	                                + X86_MAX_INSTRUCTION_LENGTH,
+	                              X86_MODE_NATIVE, offsets, TEST_MINIMUM_BYTES_DECODED+1);
+
+	if (offsets[count-1] < TEST_MINIMUM_BYTES_DECODED) {
+		printf("Failure!");
+		return false;
 	}
-	printf("%32s: %d\n", importName, codePtr - (unsigned char*)fxnPtr);
+
+	printf("%32s: %d\n", importName, offsets[count-1]);
 	return true;
 }
 
+DWORD WINAPI hooked_GetTickCount (void) {
+	return 42;
+}
+
+DWORD WINAPI hooked_GetCurrentProcessId (void) {
+	return 43;
+}
+
+static DWORD (WINAPI* next_GetTickCount)(void);
+
+DWORD WINAPI chained_GetTickCount (void) {
+	return next_GetTickCount() + 1;
+}
+
 int main (int argc, char* argv[]) {
 	static const struct {
 		const char*  testName; void* codePtr; int desiredResult;
@@ -60,8 +104,64 @@ int main (int argc, char* argv[]) {
 		{ "MUL [32]",        "\xF7\x25\x12\0\0\0",     6 },
 		{ "TEST B[R+8],8",   "\xF6\x45\x08\x01",       4 },
 		{ "MUL B[R+8]",      "\xF6\x65\x08",           3 },
+		{ "PUSH 16",         "\x66\x68\x01\0",         4 },
+		{ "XOR EAX,32",      "\x35\x01\0\0\0",         5 },
+		{ "SHL R,1",         "\xD1\xE0",               2 },
+		{ "FLD [R+8]",       "\xD9\x45\x08",           3 },
+		{ "IRET",            "\xCF",                   1 },
+		{ "CALL FAR",        "\x9A\0\0\0\0\x08\0",     7 },
+		{ "JNZ 16",          "\x66\x0F\x85\x10\0",     5 },
+		{ "CALL",            "\xE8\0\0\0\0",           5 },
+		{ "ENDBR32",         "\xF3\x0F\x1E\xFB",       4 },
+		{ "CMOVZ R,[R+8]",   "\x0F\x44\x45\x08",       4 },
+		{ "UD2",             "\x0F\x0B",               2 },
+		{ "MOVDQA X,[R]",    "\x66\x0F\x6F\x06",       4 },
+		{ "PSHUFD X,X,8",    "\x66\x0F\x70\xC1\x1B",   5 },
+		{ "PSHUFB X,X",      "\x66\x0F\x38\x00\xC1",   5 },
+		{ "PALIGNR X,X,8",   "\x66\x0F\x3A\x0F\xC1\x08",6 },
+		{ "LES R,[R]",       "\xC4\x06",               2 },
+		{ "VZEROUPPER",      "\xC5\xF8\x77",           3 },
+
+	};
 
+	static const struct {
+		const char*  testName; void* codePtr; int desiredResult;
+	} testData64[] = {
+		{ "PUSH RBP",        "\x55",                   1 },
+		{ "PUSH R12",        "\x41\x54",               2 },
+		{ "SUB RSP,8",       "\x48\x83\xEC\x28",       4 },
+		{ "MOV R,[RSP+8]",   "\x48\x8B\x44\x24\x08",   5 },
+		{ "MOV EAX,32",      "\xB8\0\0\0\0",           5 },
+		{ "MOV RAX,64",      "\x48\xB8\0\0\0\0\0\0\0\0", 10 },
+		{ "MOV AX,16",       "\x66\xB8\0\0",           4 },
+		{ "REX then 66",     "\x48\x66\xB8\0\0",       5 },
+		{ "ADD RAX,32",      "\x48\x05\0\0\0\0",       6 },
+		{ "TEST RAX,32",     "\x48\xF7\xC0\0\0\0\0",   7 },
+		{ "MOV RAX,[RIP+]",  "\x48\x8B\x05\0\0\0\0",   7 },
+		{ "LEA RCX,[RIP+]",  "\x48\x8D\x0D\0\0\0\0",   7 },
+		{ "MOV EAX,[64]",    "\xA1\0\0\0\0\0\0\0\0",   9 },
+		{ "MOV EAX,[32]",    "\x67\xA1\0\0\0\0",       6 },
+		{ "CALL",            "\xE8\0\0\0\0",           5 },
+		{ "JNZ",             "\x66\x0F\x85\0\0\0\0",   7 },
+		{ "ENDBR64",         "\xF3\x0F\x1E\xFA",       4 },
+		{ "SYSCALL",         "\x0F\x05",               2 },
+		{ "NOPW [R+R+0]",    "\x66\x0F\x1F\x44\0\0",   6 },
+		{ "MOVAPS [RSP+],X", "\x0F\x29\x74\x24\x20",   5 },
+		{ "VZEROUPPER",      "\xC5\xF8\x77",           3 },
+		{ "VMOVDQU Y,[R]",   "\xC5\xFE\x6F\x06",       4 },
+		{ "VPBROADCASTB Y,X","\xC4\xE2\x7D\x78\xC0",   5 },
+		{ "VPALIGNR Y,Y,Y,8","\xC4\xE3\x7D\x0F\xC1\x08",6 },
+		{ "VMOVDQU64 Z,[R]", "\x62\xE1\xFE\x48\x6F\x06", 6 },
+		{ "VMOVUPS [R+64],Z","\x62\xF1\x7C\x48\x11\x46\x01",7 },
+		{ "VMOVUPS Y,[RIP+]","\xC5\xFC\x10\x05\0\0\0\0", 8 },
+	};
 
+	// PUSH EBP; MOV EBP,ESP; SUB ESP,16; CALL rel32; RET; and then one
+	// byte of a MOV that got cut off by the end of the buffer.
+	static const char prologue[] = 
+		"\x55\x8B\xEC\x83\xEC\x10\xE8\0\0\0\0\xC3\x8B";
+	static const unsigned short prologueBoundaries[] = {
+		0, 1, 3, 6, 11, 12
 	};
 
 	unsigned int j,k=0;
@@ -69,22 +169,50 @@ int main (int argc, char* argv[]) {
 	HMODULE kern32;
 	PIMAGE_NT_HEADERS nthdr;
 	PIMAGE_EXPORT_DIRECTORY imexp;
-	void *gcna,*gcnw, *hpfr, *bridge;
+	void *gcna,*gcnw, *hpfr, *gtc, *bridge;
+	unsigned char* tailCode;
+	int tailJump;
+
+	static x86_stats_t stats;
+	probe_counts_t counts;
+	hook_request_t batch[2];
+	void* batchTargets[2];
 
 	DWORD *names, *funcs;
 	WORD* ords;
 	
 
+	// say so when an opcode isn't understood, not just count it
+	x86_set_failure_hook(x86_log_failure);
+
 	printf("Doing built-in test...\n");
 
 	// run opcode tests
 	for (j = 0; j < sizeof(testData)/sizeof(testData[0]); j++) {
-		if (run_opcode_test(testData[j].testName, testData[j].codePtr,
+		if (run_opcode_test(testData[j].testName, X86_MODE_32,
+		                    testData[j].codePtr,
 		                    testData[j].desiredResult) == false) {
 			k++;
 		}
 	}
 
+	printf("Doing built-in 64-bit test...\n");
+
+	for (j = 0; j < sizeof(testData64)/sizeof(testData64[0]); j++) {
+		if (run_opcode_test(testData64[j].testName, X86_MODE_64,
+		                    testData64[j].codePtr,
+		                    testData64[j].desiredResult) == false) {
+			k++;
+		}
+	}
+
+	if (run_boundary_test("Prologue", prologue, sizeof(prologue)-1,
+	                      prologueBoundaries,
+	                      sizeof(prologueBoundaries)
+	                        / sizeof(prologueBoundaries[0])) == false) {
+		k++;
+	}
+
 	if (k > 0) {
 		printf("%d failure%s!",k,k==1?"":"s");
 		return 1;
@@ -125,6 +253,103 @@ int main (int argc, char* argv[]) {
 	hpfr = GetProcAddress(kern32,"HeapFree");
 	printf("bridge_create returned: %08X\n", bridge_create(hpfr));
 
+	printf("Hooking GetTickCount...\n");
+	gtc = GetProcAddress(kern32,"GetTickCount");
+	if (hook_install(gtc, hooked_GetTickCount, &bridge) == false
+	    || GetTickCount() != 42) {
+		printf("Failure!");
+		return 1;
+	}
+	printf("Bridge to GetTickCount returned: %u\n",
+	       ((DWORD (WINAPI*)(void))bridge)());
+
+	printf("Unhooking GetTickCount.\n");
+	if (hook_remove(gtc) == false || GetTickCount() == 42) {
+		printf("Failure!");
+		return 1;
+	}
+
+	printf("Chaining two hooks on GetTickCount...\n");
+	if (hook_install(gtc, hooked_GetTickCount, &bridge) == false
+	    || hook_install(gtc, chained_GetTickCount,
+	                    (void**)&next_GetTickCount) == false
+	    || GetTickCount() != 43
+	    || hook_remove_detour(gtc, chained_GetTickCount) == false
+	    || GetTickCount() != 42
+	    || hook_remove_detour(gtc, hooked_GetTickCount) == false
+	    || GetTickCount() == 42) {
+		printf("Failure!");
+		return 1;
+	}
+
+	printf("Hooking GetTickCount and GetCurrentProcessId together...\n");
+	batch[0].target = batchTargets[0] = gtc;
+	batch[0].detour = hooked_GetTickCount;
+	batch[1].target = batchTargets[1] = 
+		GetProcAddress(kern32,"GetCurrentProcessId");
+	batch[1].detour = hooked_GetCurrentProcessId;
+	if (hook_install_batch(batch, 2) == false
+	    || GetTickCount() != 42 || GetCurrentProcessId() != 43
+	    || hook_remove_batch(batchTargets, 2) == false
+	    || GetCurrentProcessId() == 43) {
+		printf("Failure!");
+		return 1;
+	}
+
+	printf("Counting and timing calls to GetTickCount...\n");
+	if (probe_install(gtc, 1) == false) {
+		printf("Failure!");
+		return 1;
+	}
+	for (j = 0; j < 10; j++) {
+		GetTickCount();
+	}
+	if (probe_read(gtc, &counts) == false || counts.calls != 10
+	    || counts.samples != 10 || probe_remove(gtc) == false) {
+		printf("Failure!");
+		return 1;
+	}
+	printf("%llu calls, %llu ticks each\n", counts.calls,
+	       counts.ticks / counts.samples);
+
+	// MOV EAX,1 and a JMP to MOV EAX,5 / RET, both timed every call
+	printf("Timing a function that tail calls another timed one...\n");
+	tailCode = (unsigned char*)VirtualAlloc(NULL, 4096,
+	                                        MEM_COMMIT | MEM_RESERVE,
+	                                        PAGE_EXECUTE_READWRITE);
+	if (tailCode == NULL) {
+		printf("Failure!");
+		return 1;
+	}
+	tailJump = 64 - 10;
+	memcpy(&tailCode[0], "\xB8\x01\x00\x00\x00\xE9", 6);
+	memcpy(&tailCode[6], &tailJump, sizeof(tailJump));
+	memcpy(&tailCode[64], "\xB8\x05\x00\x00\x00\xC3", 6);
+	if (   probe_install(&tailCode[64], 1) == false
+	    || probe_install(tailCode, 1) == false) {
+		printf("Failure!");
+		return 1;
+	}
+	for (j = 0; j < 10; j++) {
+		if (((int (*)(void))tailCode)() != 5) {
+			printf("Failure!");
+			return 1;
+		}
+	}
+	if (   probe_read(tailCode, &counts) == false || counts.calls != 10
+	    || counts.samples != 10
+	    || probe_read(&tailCode[64], &counts) == false || counts.calls != 10
+	    || counts.samples != 0
+	    || probe_remove(tailCode) == false
+	    || probe_remove(&tailCode[64]) == false) {
+		printf("Failure!");
+		return 1;
+	}
+
+	x86_get_stats(&stats);
+	printf("%llu instructions decoded, %llu not understood, "
+	       "%llu of %llu moved relocated\n", stats.decodes, stats.failures,
+	       stats.relocations, stats.moved);
 
 	return 0;
 }
\ No newline at end of file
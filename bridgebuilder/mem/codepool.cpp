@@ -1,160 +1,1092 @@
 #include "codepool.h"
 #include <stdlib.h>
+#include <string.h>
 #ifdef _WIN32
  #define WIN32_LEAN_AND_MEAN
  #include <Windows.h>
+ #include <intrin.h>
 #else
  #include <unistd.h>
+ #include <errno.h>
+ #include <pthread.h>
  #include <sys/mman.h>
 #endif
 
+// On Linux, code pages are mapped twice from a memfd: once read/execute,
+// where the code runs, and once read/write, where it's written. Writing
+// code then never needs a protection change, and no page is ever both
+// writeable and executable. Define CODEPOOL_NO_DUAL_MAP to always use
+// single RWX/RX toggled mappings instead (which is also what we fall
+// back to if the memfd can't be created or mapped executable).
+#if defined(__linux__) && !defined(CODEPOOL_NO_DUAL_MAP)
+ #define CODEPOOL_DUAL_MAP
+#endif
+
+
+// Every page is cut up into slots of a single size class. Allocations
+// get the smallest class they fit in, so larger stubs still share pages
+// instead of taking one each. Anything over the biggest slot size gets
+// a page to itself.
+#define CODEPOOL_NUM_CLASSES CODEPOOL_NUM_SIZES
+#define CODEPOOL_CLASS_PAGE  5
+#define CODEPOOL_MIN_SLOT    16
+#define CODEPOOL_MAX_SLOT    256
+
+// the bitfields are scanned a 64-bit word at a time, and the lowest set
+// bit of a word is found with a single instruction.
+#define CODEPOOL_WORD_BITS   64
 
 struct pagedata_t {
 	void* page;
-	// bit sequence goes
-	// dfdfdfdf
-	// where d is whether it's double and f is whether it is free.
-	unsigned long bitfield[];
+	// the same memory, mapped writeable. The same as page unless it's
+	// dual-mapped.
+	void* writePage;
+	// how many codepool_unlock's are outstanding on the page. It only
+	// gets write-protected again once everybody writing to it is done.
+	unsigned long writers;
+	// which size class the page's slots are
+	unsigned char sizeClass;
+	// how many of its slots are free, and its place on its region's list
+	// of pages with any free (only linked while numFree > 0).
+	size_t numFree;
+	pagedata_t* nextFree;
+	pagedata_t* prevFree;
+	// one bit per slot, set when the slot is free, followed by another
+	// bitfieldWords words with one bit per slot set while the slot is in
+	// some thread's cache.
+	unsigned long long bitfield[];
+};
+
+// Address space is reserved an arena at a time, and pages are committed
+// out of it one by one as they're needed. Keeping all our pages together
+// like this means far fewer mappings for the OS to keep track of than
+// mapping every page on its own, and finding a pointer's page is just a
+// matter of finding its arena. Arenas are aligned to their size, which
+// has to be a power of two no bigger than a region (see below).
+#ifndef CODEPOOL_ARENA_SIZE
+ #define CODEPOOL_ARENA_SIZE (2*1024*1024)
+#endif
+
+struct arena_t {
+	// where the arena's code runs, and where it can be written to. The
+	// same unless the arena is dual-mapped.
+	char* base;
+	char* writeBase;
+
+	// pages are committed in order, these are the first numCommitted.
+	size_t volatile numCommitted;
+
+	#ifdef CODEPOOL_DUAL_MAP
+		// where the arena is in the memfd
+		size_t fdOffset;
+	#endif
+
+	// pageDataUnitSize bytes of pagedata_t for every page in the arena.
+	// pagedata_t's size depends on pageSize and can't be determined at
+	// compile time (even though it's almost always 4KB), so we can't use
+	// an index with this, we'll just have to be typecasting the hell out
+	// of it.
+	char* pageMetaDataArray;
+};
+
+// Arenas are kept in separate lists by which 1GB region of the address
+// space they are in. Code allocated near some target has to be within
+// rel32 reach of it (+/-2GB), and every page in the target's own region
+// or the regions on either side of it is, so a near allocation only
+// ever has to look at three lists.
+#define CODEPOOL_REGION_SHIFT 30
+
+struct region_t {
+	// address >> CODEPOOL_REGION_SHIFT
+	size_t key;
+
+	// the region's newest arena, the only one that might still have
+	// pages left to commit.
+	arena_t* arena;
+
+	// the region's pages that have a free slot, one list per size
+	// class. Full pages drop off their list and come back when a slot
+	// in them is freed, so allocating never has to look at them. (the
+	// metadata itself lives in the arenas and never moves.)
+	pagedata_t* freePages[CODEPOOL_NUM_CLASSES];
 };
 
-static size_t numPages = 0;
 static size_t pageSize = 0;
-static size_t numPageSlices = 0;
-static size_t pageDataUnitSize = 0;
+// set last by codepool_init, so it's also our is-initialized flag
+static size_t volatile pageDataUnitSize = 0;
+// how many words each of a page's bitfields takes
+static size_t bitfieldWords = 0;
+
+static region_t* regions = NULL;
+static size_t numRegions = 0;
+
+static arena_t** arenas = NULL;
+static size_t numArenas = 0;
+
+#ifdef CODEPOOL_DUAL_MAP
+ // the memfd every dual-mapped arena comes out of, or -1 if we aren't
+ // dual-mapping, and how much of it is in use.
+ static int poolFd = -1;
+ static size_t poolFdSize = 0;
+#endif
+
+// Freeing has to get from a pointer back to its page's metadata, so
+// every arena is also put in a hash table keyed by its address. It's
+// open addressed (linear probing) with a power of two size, and kept at
+// most half full. Arenas are never given back to the OS, so nothing ever
+// has to be removed from it.
+//
+// codepool_free reads the table without taking the lock. An entry's base
+// is always set last, so a reader that sees it sees the arena too, and a
+// table that gets outgrown is kept around (the new one points back to
+// it) since somebody may still be reading it. The old ones together are
+// never bigger than the current one.
+struct arenaindex_t {
+	void* volatile base;
+	arena_t* arena;
+};
+
+struct arenatable_t {
+	size_t size;
+	size_t used;
+	arenatable_t* retired;
+	arenaindex_t entries[];
+};
+
+#define CODEPOOL_INDEX_MIN_SIZE 16
+
+static arenatable_t* volatile arenaTable = NULL;
+
+#ifdef _WIN32
+ // volatile accesses have acquire/release semantics with MSVC
+ #define CODEPOOL_LOAD_ACQUIRE(var)       (var)
+ #define CODEPOOL_STORE_RELEASE(var,val)  ((var) = (val))
+ #define CODEPOOL_THREAD                  __declspec(thread)
+ #define CODEPOOL_COUNT(var)              InterlockedIncrement64((LONGLONG volatile*)&(var))
+ #define CODEPOOL_BITS_SET(word,bits)     InterlockedOr64((LONGLONG volatile*)(word), (LONGLONG)(bits))
+ #define CODEPOOL_BITS_CLEAR(word,bits)   InterlockedAnd64((LONGLONG volatile*)(word), ~(LONGLONG)(bits))
+
+ static SRWLOCK poolLock = SRWLOCK_INIT;
+ static DWORD cacheKey = FLS_OUT_OF_INDEXES;
+#else
+ #define CODEPOOL_LOAD_ACQUIRE(var)       __atomic_load_n(&(var), __ATOMIC_ACQUIRE)
+ #define CODEPOOL_STORE_RELEASE(var,val)  __atomic_store_n(&(var), (val), __ATOMIC_RELEASE)
+ #define CODEPOOL_THREAD                  __thread
+ #define CODEPOOL_COUNT(var)              __atomic_fetch_add(&(var), 1, __ATOMIC_RELAXED)
+ #define CODEPOOL_BITS_SET(word,bits)     __atomic_fetch_or((word), (bits), __ATOMIC_RELAXED)
+ #define CODEPOOL_BITS_CLEAR(word,bits)   __atomic_fetch_and((word), ~(bits), __ATOMIC_RELAXED)
+
+ static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+ static pthread_key_t cacheKey;
+ static bool cacheKeyCreated = false;
+#endif
+
+// Every thread keeps a few free slices of each size to itself, so most
+// allocs and frees don't have to touch the bitfields (or wait on the
+// lock to do it). Cached slices are still marked allocated in their
+// page's bitfield; codepool_flush_cache gives them back for real. They
+// are also marked cached, so codepool_free can tell a slice sitting in
+// any thread's cache has already been freed. That mark is cleared
+// without the lock when a thread takes a slice back out of its cache,
+// so it's only ever changed atomically. Whole pages are too big to be
+// worth hoarding, so they aren't cached.
+#define CODEPOOL_CACHE_SIZE  16
+#define CODEPOOL_CACHE_BATCH 8
+
+struct slicecache_t {
+	void* slices[CODEPOOL_CACHE_SIZE];
+	size_t count;
+};
+
+// one per size class, except whole pages
+static CODEPOOL_THREAD slicecache_t threadCache[CODEPOOL_CLASS_PAGE];
+static CODEPOOL_THREAD bool threadCacheRegistered = false;
+
+// Inside a codepool_begin_write/codepool_commit, a thread collects the
+// pages it unlocks here instead of locking them again each time, and
+// they all get locked once at the commit.
+static CODEPOOL_THREAD size_t txDepth = 0;
+static CODEPOOL_THREAD pagedata_t** txPages = NULL;
+static CODEPOOL_THREAD size_t txNumPages = 0;
+static CODEPOOL_THREAD size_t txMaxPages = 0;
+
+// for codepool_get_stats. Not always changed under the lock (foreign
+// pages are unlocked without it), so it's counted atomically.
+static unsigned long long volatile protectionChanges = 0;
+
+
+void codepool_can_write (void* codeMemory, bool canWrite);
+
+__inline void codepool_enter (void) {
+	#ifdef _WIN32
+		AcquireSRWLockExclusive(&poolLock);
+	#else
+		pthread_mutex_lock(&poolLock);
+	#endif
+}
+
+__inline void codepool_leave (void) {
+	#ifdef _WIN32
+		ReleaseSRWLockExclusive(&poolLock);
+	#else
+		pthread_mutex_unlock(&poolLock);
+	#endif
+}
+
+static bool codepool_tx_find (pagedata_t* pageMetaData) {
+	size_t j;
+
+	for (j = 0; j < txNumPages; j++) {
+		if (txPages[j] == pageMetaData) {
+			return true;
+		}
+	}
+	return false;
+}
 
+// Remembers the page for this thread's commit. Returns false if there
+// is no transaction going (or no memory to remember it in), and the
+// page's protection has to be dealt with right away.
+static bool codepool_tx_add (pagedata_t* pageMetaData) {
+	pagedata_t** newPages;
 
+	if (txDepth == 0) {
+		return false;
+	}
 
-// allocated off heap memory. Technically a pointer to an array of
-// pagedata_t's, but because pagedata_t's size depends on pageSize
-// and cannot be determined at compile time (even though it's almost
-// always 4KB),  it's probably easier on everybody we just make this
-// a void ptr, since we won't be able to use an index anyway, and will
-// be typecasting the hell out of this.
-static void* pageMetaDataArray; 
+	if (txNumPages == txMaxPages) {
+		newPages = (pagedata_t**)realloc(txPages, 
+		             sizeof(pagedata_t*) * (txMaxPages ? txMaxPages*2 : 16));
+		if (newPages == NULL) {
+			return false;
+		}
+		txPages = newPages;
+		txMaxPages = txMaxPages ? txMaxPages*2 : 16;
+	}
+	txPages[txNumPages++] = pageMetaData;
+	return true;
+}
 
+// Page write-protection, counting writers. must hold the lock
+static void codepool_page_unlock (pagedata_t* pageMetaData) {
+	// dual-mapped pages are always writeable through writePage
+	if (pageMetaData->writePage != pageMetaData->page) {
+		return;
+	}
+
+	// already unlocked for this thread's transaction
+	if (txDepth > 0 && codepool_tx_find(pageMetaData) == true) {
+		return;
+	}
+	codepool_tx_add(pageMetaData);
+
+	if (pageMetaData->writers++ == 0) {
+		codepool_can_write(pageMetaData->page,true);
+	}
+}
+
+static void codepool_page_lock (pagedata_t* pageMetaData) {
+	if (pageMetaData->writePage != pageMetaData->page) {
+		return;
+	}
+
+	// stays unlocked until the commit
+	if (txDepth > 0 && codepool_tx_find(pageMetaData) == true) {
+		return;
+	}
+
+	if (pageMetaData->writers > 0 && --pageMetaData->writers == 0) {
+		codepool_can_write(pageMetaData->page,false);
+	}
+}
 
 __inline void* codepool_align_pointer (void* ptr, size_t alignment) {
 	return (void*)(size_t(ptr) & ~(alignment-1));
 }
 
-__inline bool pointer_to_sub (void* ptr, unsigned long** word,unsigned char* bitNum) {
-	size_t pageNum,ptrDistance;
-	
-	pagedata_t* pageMetaData;
+// puts a page at the head of its region's free list
+__inline void region_link_page (region_t* region, pagedata_t* pageMetaData) {
+	pagedata_t** head = &region->freePages[pageMetaData->sizeClass];
 
-	void* pagePtr = codepool_align_pointer(ptr,pageSize);
+	pageMetaData->prevFree = NULL;
+	pageMetaData->nextFree = *head;
+	if (*head != NULL) {
+		(*head)->prevFree = pageMetaData;
+	}
+	*head = pageMetaData;
+}
 
-	ptrDistance = size_t(ptr) - size_t(pagePtr);
+// takes a page off its region's free list
+__inline void region_unlink_page (region_t* region, pagedata_t* pageMetaData) {
+	if (pageMetaData->prevFree != NULL) {
+		pageMetaData->prevFree->nextFree = pageMetaData->nextFree;
+	} else {
+		region->freePages[pageMetaData->sizeClass] = pageMetaData->nextFree;
+	}
+	if (pageMetaData->nextFree != NULL) {
+		pageMetaData->nextFree->prevFree = pageMetaData->prevFree;
+	}
+	pageMetaData->nextFree = NULL;
+	pageMetaData->prevFree = NULL;
+}
 
-	for (pageNum = numPages-1; pageNum >= 0; pageNum--) {
+__inline pagedata_t* arena_page (arena_t* arena, size_t pageNum) {
+	return (pagedata_t*)(arena->pageMetaDataArray + pageDataUnitSize*pageNum);
+}
 
-		// Setting up pointer using maths, because we can't use an
-		// array index with variably-sized data
-		pageMetaData = (pagedata_t*)((char*)pageMetaDataArray 
-	                                         + pageDataUnitSize*pageNum);
-		
-		// we have found the page!
-		if (pagePtr == pageMetaData->page) {
-			*bitNum = (ptrDistance&64)/16;
-			*word = &pageMetaData->bitfield[ptrDistance/64];
-			return true;
+// the smallest size class newCodeSize fits in
+__inline int codepool_size_class (size_t newCodeSize) {
+	int sizeClass = 0;
+
+	while (sizeClass < CODEPOOL_CLASS_PAGE 
+	       && newCodeSize > ((size_t)CODEPOOL_MIN_SLOT << sizeClass)) {
+		sizeClass++;
+	}
+	return sizeClass;
+}
+
+__inline size_t codepool_slot_size (int sizeClass) {
+	if (sizeClass == CODEPOOL_CLASS_PAGE) {
+		return pageSize;
+	}
+	return (size_t)CODEPOOL_MIN_SLOT << sizeClass;
+}
+
+static region_t* codepool_find_region (size_t key) {
+	size_t regionNum;
+
+	for (regionNum = 0; regionNum < numRegions; regionNum++) {
+		if (regions[regionNum].key == key) {
+			return &regions[regionNum];
 		}
 	}
-	// didn't find the page metadata.
-	return false;
+	return NULL;
+}
+
+__inline size_t codepool_hash_arena (void* base, size_t tableSize) {
+	// the low bits of an arena address are always zero, so drop them and
+	// let a multiplicative hash spread the rest over the table.
+	return (size_t(base)/CODEPOOL_ARENA_SIZE * (size_t)2654435761u) 
+	       & (tableSize-1);
+}
+
+static void codepool_index_put (arenatable_t* table, arena_t* arena) {
+	size_t slot = codepool_hash_arena(arena->base, table->size);
+
+	while (table->entries[slot].base != NULL) {
+		slot = (slot+1) & (table->size-1);
+	}
+	table->entries[slot].arena = arena;
+	CODEPOOL_STORE_RELEASE(table->entries[slot].base, arena->base);
+	table->used++;
+}
+
+// must hold the lock
+static bool codepool_index_add (arena_t* arena) {
+	arenatable_t *table, *newTable;
+	size_t newSize, slot;
+
+	table = arenaTable;
+
+	// grow the table before it gets more than half full, so lookups
+	// stay a probe or two long.
+	if (table == NULL || (table->used+1)*2 > table->size) {
+		newSize = table ? table->size*2 : CODEPOOL_INDEX_MIN_SIZE;
+		newTable = (arenatable_t*)calloc(1, sizeof(arenatable_t)
+		                                    + newSize*sizeof(arenaindex_t));
+		if (newTable == NULL) {
+			return false;
+		}
+		newTable->size = newSize;
+		newTable->retired = table;
+
+		if (table != NULL) {
+			for (slot = 0; slot < table->size; slot++) {
+				if (table->entries[slot].base != NULL) {
+					codepool_index_put(newTable, table->entries[slot].arena);
+				}
+			}
+		}
+		CODEPOOL_STORE_RELEASE(arenaTable, newTable);
+		table = newTable;
+	}
+
+	codepool_index_put(table, arena);
+
+	return true;
+}
+
+// Finds the metadata of the page ptr is in, if it's one of ours. safe
+// to call without the lock
+static pagedata_t* codepool_index_find (void* ptr) {
+	arenatable_t* table = CODEPOOL_LOAD_ACQUIRE(arenaTable);
+	void* base = codepool_align_pointer(ptr, CODEPOOL_ARENA_SIZE);
+	void* entryBase;
+	arena_t* arena;
+	size_t slot, pageNum;
+
+	if (table == NULL) {
+		return NULL;
+	}
+
+	slot = codepool_hash_arena(base, table->size);
+	while ((entryBase = CODEPOOL_LOAD_ACQUIRE(table->entries[slot].base)) 
+	         != NULL) {
+		if (entryBase == base) {
+			arena = table->entries[slot].arena;
+
+			// and from there it's just maths
+			pageNum = (size_t(ptr) - size_t(base)) / pageSize;
+			if (pageNum >= CODEPOOL_LOAD_ACQUIRE(arena->numCommitted)) {
+				return NULL;
+			}
+			return arena_page(arena, pageNum);
+		}
+		slot = (slot+1) & (table->size-1);
+	}
+	return NULL;
+}
+
+__inline void pointer_to_sub (pagedata_t* pageMetaData, void* ptr,
+                             unsigned long long** word, unsigned char* bitNum) {
+	size_t slotNum;
+
+	slotNum = (size_t(ptr) - size_t(pageMetaData->page)) 
+	            / codepool_slot_size(pageMetaData->sizeClass);
+
+	*bitNum = (unsigned char)(slotNum % CODEPOOL_WORD_BITS);
+	*word = &pageMetaData->bitfield[slotNum / CODEPOOL_WORD_BITS];
 }
 
 __inline void* sub_to_pointer (pagedata_t* pageMetaData, size_t wordNum, size_t bitNum) {
 
 	return (void*)((size_t)pageMetaData->page 
-	               + (wordNum*sizeof(unsigned long)+bitNum)*16);
+	               + (wordNum*CODEPOOL_WORD_BITS + bitNum) 
+	                   * codepool_slot_size(pageMetaData->sizeClass));
 }
 	
 
-__inline void sub_set_allocated (unsigned long *word, unsigned char index, bool isDouble) {
-	index *= 2;
+__inline void sub_set_allocated (unsigned long long *word, unsigned char index) {
+	*word &= ~(1ULL << index);
+}
+
+__inline void sub_set_free (unsigned long long *word, unsigned char index) {
+	*word |= 1ULL << index;
+}
+
+__inline bool sub_is_free (unsigned long long word, unsigned char index) {
+	return ((word&(1ULL << index)) != 0);
+}
+
+// the word with the cached bits that go with a word of free bits
+__inline unsigned long long* sub_cached_word (unsigned long long* word) {
+	return word + bitfieldWords;
+}
 
-	// clear out the free bits
-	*word &= ~(3<<index);
-	// add the double bit if necessary
-	if(isDouble) {
-		*word |= 2 << index;
+__inline void sub_set_cached (unsigned long long* word, unsigned char index,
+                              bool cached) {
+	if (cached) {
+		CODEPOOL_BITS_SET(sub_cached_word(word), 1ULL << index);
+	} else {
+		CODEPOOL_BITS_CLEAR(sub_cached_word(word), 1ULL << index);
 	}
 }
 
-__inline void sub_set_free (unsigned long *word, unsigned char index) {
-	index *= 2;
+__inline bool sub_is_cached (unsigned long long* word, unsigned char index) {
+	return ((CODEPOOL_LOAD_ACQUIRE(*sub_cached_word(word))
+	         & (1ULL << index)) != 0);
+}
 
-	// clear out the double bit
-	*word &= ~(3 << index);
-	// set the free bit
-	*word |= 1 << index;
+// marks a slice going into or coming out of a thread's cache
+static void codepool_mark_cached (void* codeMemory, bool cached) {
+	pagedata_t* pageMetaData;
+	unsigned long long* bits;
+	unsigned char bitNum;
+
+	pageMetaData = codepool_index_find(
+		codepool_align_pointer(codeMemory,pageSize));
+	if (pageMetaData != NULL) {
+		pointer_to_sub(pageMetaData,codeMemory,&bits,&bitNum);
+		sub_set_cached(bits, bitNum, cached);
+	}
+}
+
+// index of the lowest set bit. word must not be 0.
+__inline unsigned char sub_first_free (unsigned long long word) {
+	#if defined(_MSC_VER) && defined(_WIN64)
+		unsigned long index;
+		_BitScanForward64(&index, word);
+		return (unsigned char)index;
+	#elif defined(_MSC_VER)
+		unsigned long index;
+		if (_BitScanForward(&index, (unsigned long)word) == 0) {
+			_BitScanForward(&index, (unsigned long)(word >> 32));
+			index += 32;
+		}
+		return (unsigned char)index;
+	#else
+		return (unsigned char)__builtin_ctzll(word);
+	#endif
+}
+
+
+// Reserves an arena's worth of address space, aligned to its size, at
+// hint if we can. Nothing in it can be used until it's committed. To get
+// the alignment, we reserve twice as much and keep the aligned half.
+static char* codepool_reserve (void* hint) {
+	char* raw;
+	char* base;
+
+	#ifdef _WIN32
+		raw = (char*)VirtualAlloc(hint,
+		                          CODEPOOL_ARENA_SIZE*2,
+		                          MEM_RESERVE,
+		                          PAGE_NOACCESS);
+		if (raw == NULL) {
+			return NULL;
+		}
+
+		// windows can't give back part of a reservation, so let go of it
+		// all and take the aligned part again. Somebody else could get
+		// there first in between, in which case we just fail this try.
+		base = (char*)codepool_align_pointer(raw + CODEPOOL_ARENA_SIZE-1,
+		                                     CODEPOOL_ARENA_SIZE);
+		VirtualFree(raw, 0, MEM_RELEASE);
+
+		base = (char*)VirtualAlloc(base,
+		                           CODEPOOL_ARENA_SIZE,
+		                           MEM_RESERVE,
+		                           PAGE_NOACCESS);
+	#else
+		raw = (char*)mmap(hint,
+		                  CODEPOOL_ARENA_SIZE*2,
+		                  PROT_NONE,
+		                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+		                  -1, 0);
+		if (raw == MAP_FAILED) {
+			return NULL;
+		}
+
+		base = (char*)codepool_align_pointer(raw + CODEPOOL_ARENA_SIZE-1,
+		                                     CODEPOOL_ARENA_SIZE);
+		if (base != raw) {
+			munmap(raw, base - raw);
+		}
+		munmap(base + CODEPOOL_ARENA_SIZE, 
+		       raw + CODEPOOL_ARENA_SIZE*2 - (base + CODEPOOL_ARENA_SIZE));
+	#endif
+
+	return base;
 }
 
-__inline bool sub_is_free (unsigned long word, unsigned char index) {
-	return ((word&(1<<(index*2))) != 0);
+static void codepool_release (char* base) {
+	#ifdef _WIN32
+		VirtualFree(base, 0, MEM_RELEASE);
+	#else
+		munmap(base, CODEPOOL_ARENA_SIZE);
+	#endif
 }
 
-__inline bool sub_is_dbl (unsigned long word, unsigned char index) {
-	return ((word&(2<<(index*2))) != 0);
+// where codeMemory can be written to
+__inline void* codepool_write_pointer (pagedata_t* pageMetaData,
+                                       void* codeMemory) {
+	return (char*)pageMetaData->writePage 
+	       + (size_t(codeMemory) - size_t(pageMetaData->page));
 }
 
+// Is the address in one of the three regions around nearTarget, and so
+// within rel32 reach of it?
+__inline bool codepool_is_near (void* page, void* nearTarget) {
+	size_t key = size_t(page) >> CODEPOOL_REGION_SHIFT;
+	size_t targetKey = size_t(nearTarget) >> CODEPOOL_REGION_SHIFT;
 
-bool codepool_addpage (void) {
-	pagedata_t* pageMetaData;
-	// calculate new size of the allocator meta-data
-	size_t newSize = pageDataUnitSize * (numPages+1);
+	return key + 1 >= targetKey && key <= targetKey + 1;
+}
+
+// Reserves an arena at hint, and keeps it if it is near enough to
+// nearTarget.
+static char* codepool_reserve_at (size_t hint, void* nearTarget) {
+	char* base = codepool_reserve((void*)hint);
+
+	if (base != NULL && codepool_is_near(base, nearTarget) == false) {
+		codepool_release(base);
+		base = NULL;
+	}
+	return base;
+}
+
+// Reserves an arena within rel32 reach of nearTarget. The OS only treats
+// our address as a hint (on *nix) or fails if it's taken (on windows), so
+// we probe for free space and check where we actually ended up.
+static char* codepool_reserve_near (void* nearTarget) {
+	size_t distance, base, key, regionNum;
+	region_t* region;
+	char* arenaBase;
+	int direction;
+
+	// the first try is the same as asking for no particular address,
+	// which usually lands near shared libraries anyway.
+	arenaBase = codepool_reserve_at(0, nearTarget);
+	if (arenaBase != NULL) {
+		return arenaBase;
+	}
+
+	// Our arenas pile up next to each other, so right beside the newest
+	// one we already have near the target is likely to be free.
+	key = size_t(nearTarget) >> CODEPOOL_REGION_SHIFT;
+	for (regionNum = key-1; regionNum != key+2; regionNum++) {
+		region = codepool_find_region(regionNum);
+		if (region == NULL || region->arena == NULL) {
+			continue;
+		}
+		base = size_t(region->arena->base);
+
+		arenaBase = codepool_reserve_at(base - CODEPOOL_ARENA_SIZE, 
+		                                nearTarget);
+		if (arenaBase == NULL) {
+			arenaBase = codepool_reserve_at(base + CODEPOOL_ARENA_SIZE, 
+			                                nearTarget);
+		}
+		if (arenaBase != NULL) {
+			return arenaBase;
+		}
+	}
+
+	// Otherwise probe outwards from the target, doubling the distance
+	// each time.
+	base = size_t(codepool_align_pointer(nearTarget, CODEPOOL_ARENA_SIZE));
+
+	for (distance = CODEPOOL_ARENA_SIZE;
+	     distance < ((size_t)1 << CODEPOOL_REGION_SHIFT);
+	     distance *= 2) {
+		for (direction = -1; direction <= 1; direction += 2) {
+			// don't wrap around the ends of the address space
+			if (direction < 0 && distance > base) {
+				continue;
+			}
+			if (direction > 0 && base + distance < base) {
+				continue;
+			}
+
+			arenaBase = codepool_reserve_at(base + direction*distance, 
+			                                nearTarget);
+			if (arenaBase != NULL) {
+				return arenaBase;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+// returns the region an address is in, creating it if needed
+static region_t* codepool_get_region (void* page) {
+	region_t* region;
+	size_t key = size_t(page) >> CODEPOOL_REGION_SHIFT;
+
+	region = codepool_find_region(key);
+	if (region != NULL) {
+		return region;
+	}
+
+	region = (region_t*)realloc(regions, sizeof(region_t) * (numRegions+1));
+	if (region == NULL) {
+		return NULL;
+	}
+	regions = region;
+
+	region = &regions[numRegions++];
+	memset(region, 0, sizeof(region_t));
+	region->key = key;
 
-	// allocate or resize our memory
-	if (numPages == 0) {
-		pageMetaDataArray = (void*)malloc(newSize);
+	return region;
+}
+
+#ifdef CODEPOOL_DUAL_MAP
+// Replaces an arena's reservation with a view of the next stretch of
+// the memfd, and maps a writeable view of the same stretch anywhere.
+// Both start out inaccessible, like any other reservation.
+static bool codepool_map_views (arena_t* arena) {
+	void* view;
+
+	if (ftruncate(poolFd, poolFdSize + CODEPOOL_ARENA_SIZE) != 0) {
+		return false;
+	}
+
+	view = mmap(NULL, CODEPOOL_ARENA_SIZE, PROT_NONE, MAP_SHARED,
+	            poolFd, poolFdSize);
+	if (view == MAP_FAILED) {
+		return false;
+	}
+	if (mmap(arena->base, CODEPOOL_ARENA_SIZE, PROT_NONE, 
+	         MAP_SHARED | MAP_FIXED, poolFd, poolFdSize) == MAP_FAILED) {
+		munmap(view, CODEPOOL_ARENA_SIZE);
+		return false;
+	}
+
+	arena->writeBase = (char*)view;
+	arena->fdOffset = poolFdSize;
+	poolFdSize += CODEPOOL_ARENA_SIZE;
+
+	return true;
+}
+#endif
+
+// Reserves a new arena and sets it up as its region's newest. must hold
+// the lock
+static arena_t* codepool_add_arena (void* nearTarget) {
+	arena_t* arena;
+	arena_t** newArray;
+	region_t* region;
+	char* base;
+
+	if (nearTarget != NULL) {
+		base = codepool_reserve_near(nearTarget);
 	} else {
-		pageMetaDataArray = (void*)realloc(pageMetaDataArray, newSize);
+		base = codepool_reserve(NULL);
+	}
+	if (base == NULL) {
+		return NULL;
+	}
+
+	newArray = (arena_t**)realloc(arenas, sizeof(arena_t*) * (numArenas+1));
+	if (newArray != NULL) {
+		arenas = newArray;
+	}
+
+	region = codepool_get_region(base);
+	arena = (arena_t*)calloc(1, sizeof(arena_t));
+	if (region == NULL || newArray == NULL || arena == NULL) {
+		free(arena);
+		codepool_release(base);
+		return NULL;
+	}
+
+	arena->pageMetaDataArray = (char*)calloc(CODEPOOL_ARENA_SIZE/pageSize,
+	                                         pageDataUnitSize);
+	if (arena->pageMetaDataArray == NULL) {
+		free(arena);
+		codepool_release(base);
+		return NULL;
+	}
+	arena->base = base;
+	arena->writeBase = base;
+
+	#ifdef CODEPOOL_DUAL_MAP
+		if (poolFd != -1 && codepool_map_views(arena) == false) {
+			free(arena->pageMetaDataArray);
+			free(arena);
+			codepool_release(base);
+			return NULL;
+		}
+	#endif
+
+	// and make it so we can find it again when freeing
+	if (codepool_index_add(arena) == false) {
+		if (arena->writeBase != base) {
+			codepool_release(arena->writeBase);
+		}
+		free(arena->pageMetaDataArray);
+		free(arena);
+		codepool_release(base);
+		return NULL;
 	}
 
-	// increment the page count
-	numPages++;
+	arenas[numArenas++] = arena;
+	region->arena = arena;
+
+	return arena;
+}
 
-	// initialize our added data and allocate a virtual memory page
-	// for it (I really hate typecasting sometimes.)
-	pageMetaData = (pagedata_t*)((char*)pageMetaDataArray 
-	                              + pageDataUnitSize*(numPages-1));
+// Commits the arena's next page, leaving it writeable (or, if dual-mapped,
+// its executable view executable and its writeable view writeable). 
+static void* codepool_commit_page (arena_t* arena) {
+	char* page = arena->base + arena->numCommitted*pageSize;
 
 	#ifdef _WIN32
-		pageMetaData->page = VirtualAlloc(NULL,
-		                                  pageSize,
-		                                  MEM_COMMIT | MEM_RESERVE,
-		                                  PAGE_EXECUTE_READWRITE);
+		CODEPOOL_COUNT(protectionChanges);
+		if (VirtualAlloc(page, pageSize, MEM_COMMIT,
+		                 PAGE_EXECUTE_READWRITE) == NULL) {
+			return NULL;
+		}
 	#else
-		pageMetaData->page = mmap(NULL,
-		                          pageSize,
-		                          PROT_READ | PROT_WRITE | PROT_EXEC,
-		                          MAP_ANONYMOUS,
-		                          -1, 0)
+		if (arena->writeBase != arena->base) {
+			CODEPOOL_COUNT(protectionChanges);
+			CODEPOOL_COUNT(protectionChanges);
+			if (mprotect(page, pageSize, PROT_READ | PROT_EXEC) != 0
+			    || mprotect(arena->writeBase + (page - arena->base), pageSize,
+			                PROT_READ | PROT_WRITE) != 0) {
+				return NULL;
+			}
+		} else {
+			CODEPOOL_COUNT(protectionChanges);
+			if (mprotect(page, pageSize,
+			             PROT_READ | PROT_WRITE | PROT_EXEC) != 0) {
+				return NULL;
+			}
+		}
 	#endif
 
-	// NULL is for WIN32 and -1 is for *nix, Although thanks to page
-	// boundaries -1 isn't valid anywhere. more ifdefs would disrupt
-	// code clarity, so I'm leaving it as it is here.
-	if (pageMetaData == NULL || pageMetaData == (void*) -1 ) {
+	return page;
+}
+
+// must hold the lock
+bool codepool_addpage (int sizeClass, void* nearTarget) {
+	pagedata_t* pageMetaData;
+	region_t* region;
+	arena_t* arena;
+	void* page;
+	size_t slotNum, regionNum, key;
+
+	// find an arena with pages left in it. Only each region's newest
+	// one can have any.
+	arena = NULL;
+	if (nearTarget != NULL) {
+		key = size_t(nearTarget) >> CODEPOOL_REGION_SHIFT;
+		for (regionNum = key-1; regionNum != key+2; regionNum++) {
+			region = codepool_find_region(regionNum);
+			if (region != NULL && region->arena != NULL
+			    && region->arena->numCommitted < CODEPOOL_ARENA_SIZE/pageSize) {
+				arena = region->arena;
+				break;
+			}
+		}
+	} else {
+		for (regionNum = 0; regionNum < numRegions; regionNum++) {
+			region = &regions[regionNum];
+			if (region->arena != NULL
+			    && region->arena->numCommitted < CODEPOOL_ARENA_SIZE/pageSize) {
+				arena = region->arena;
+				break;
+			}
+		}
+	}
+
+	// or start a new one
+	if (arena == NULL) {
+		arena = codepool_add_arena(nearTarget);
+		if (arena == NULL) {
+			return false;
+		}
+	}
+	region = codepool_find_region(size_t(arena->base) >> CODEPOOL_REGION_SHIFT);
+
+	page = codepool_commit_page(arena);
+	if (page == NULL) {
 		return false;
 	}
 
+	// initialize our added data (I really hate typecasting sometimes.)
+	pageMetaData = arena_page(arena, arena->numCommitted);
+	pageMetaData->page = page;
+	pageMetaData->writePage = arena->writeBase + ((char*)page - arena->base);
+	pageMetaData->writers = 0;
+	pageMetaData->sizeClass = (unsigned char)sizeClass;
+	pageMetaData->numFree = pageSize/codepool_slot_size(sizeClass);
+
 	// Initialize the memory page with 0xCC, the INT3 instruction. A
 	// good trap for errant execution.
-	memset(pageMetaData->page, 0xCC, pageSize);
+	memset(pageMetaData->writePage, 0xCC, pageSize);
 
-	// initialize the bitfield to free
-	memset(pageMetaData->bitfield, 0x55, 
-	       pageDataUnitSize - sizeof(pagedata_t));
+	// initialize the bitfield to free, one bit for each slot that fits
+	memset(pageMetaData->bitfield, 0, pageDataUnitSize - sizeof(pagedata_t));
+	for (slotNum = 0; slotNum < pageMetaData->numFree; slotNum++) {
+		sub_set_free(&pageMetaData->bitfield[slotNum / CODEPOOL_WORD_BITS],
+		             (unsigned char)(slotNum % CODEPOOL_WORD_BITS));
+	}
 
-	// remove write permission from the page
-	codepool_lock(pageMetaData->page);
+	// now it can be found
+	CODEPOOL_STORE_RELEASE(arena->numCommitted, arena->numCommitted+1);
+	region_link_page(region, pageMetaData);
+
+	// remove write permission from the page. If this thread is in a
+	// write transaction, it's about to be written to anyway, so it just
+	// stays writeable until the commit. (a dual-mapped page's executable
+	// view was never writeable.)
+	if (pageMetaData->writePage != page) {
+		// nothing to do
+	} else if (codepool_tx_add(pageMetaData) == true) {
+		pageMetaData->writers = 1;
+	} else {
+		codepool_can_write(pageMetaData->page, false);
+	}
 
 	// That ought to do it!
 	return true;
 }
 
+#ifdef _WIN32
+static void WINAPI codepool_thread_exit (void* unused) {
+	codepool_flush_cache();
+}
+#else
+static void codepool_thread_exit (void* unused) {
+	codepool_flush_cache();
+}
+#endif
+
+#ifdef CODEPOOL_DUAL_MAP
+// Some systems won't allow executable memfds at all, in which case we
+// stick to single mappings.
+static bool codepool_can_exec_fd (void) {
+	void* view;
+
+	if (ftruncate(poolFd, pageSize) != 0) {
+		return false;
+	}
+	view = mmap(NULL, pageSize, PROT_READ | PROT_EXEC, MAP_SHARED, poolFd, 0);
+	if (view == MAP_FAILED) {
+		return false;
+	}
+	munmap(view, pageSize);
+	return true;
+}
+
+static void codepool_fork_prepare (void) {
+	codepool_enter();
+}
+
+static void codepool_fork_parent (void) {
+	codepool_leave();
+}
+
+// pwrite all of it, however many goes that takes
+static bool codepool_write_fd (int fd, const char* data, size_t size,
+                               size_t offset) {
+	ssize_t written;
+
+	while (size > 0) {
+		written = pwrite(fd, data, size, offset);
+		if (written == -1 && errno == EINTR) {
+			continue;
+		}
+		if (written <= 0) {
+			return false;
+		}
+		data += written;
+		size -= written;
+		offset += written;
+	}
+	return true;
+}
+
+// Puts a copy of a dual-mapped arena's pages into the child's own memfd
+// and maps both views from there instead. If this fails the arena may be
+// half remapped, and codepool_fork_private has to take over.
+static bool codepool_fork_shared (arena_t* arena, int newFd,
+                                  const char* contents, size_t committed) {
+	if (codepool_write_fd(newFd, contents, committed, arena->fdOffset) == false
+	    || mmap(arena->base, CODEPOOL_ARENA_SIZE, PROT_NONE,
+	            MAP_SHARED | MAP_FIXED, newFd, arena->fdOffset) == MAP_FAILED
+	    || mmap(arena->writeBase, CODEPOOL_ARENA_SIZE, PROT_NONE,
+	            MAP_SHARED | MAP_FIXED, newFd, arena->fdOffset) == MAP_FAILED) {
+		return false;
+	}
+	if (committed > 0
+	    && (mprotect(arena->base, committed, PROT_READ | PROT_EXEC) != 0
+	        || mprotect(arena->writeBase, committed,
+	                    PROT_READ | PROT_WRITE) != 0)) {
+		return false;
+	}
+	return true;
+}
+
+// Turns a dual-mapped arena into a private single mapping with the same
+// contents, for when it can't have a memfd of its own. Its pages are then
+// written like any other single-mapped ones, by changing protection.
+static bool codepool_fork_private (arena_t* arena, const char* contents,
+                                   size_t committed) {
+	size_t pageNum;
+	pagedata_t* pageMetaData;
+
+	if (mmap(arena->base, CODEPOOL_ARENA_SIZE, PROT_NONE,
+	         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+	         -1, 0) == MAP_FAILED) {
+		return false;
+	}
+	if (committed > 0) {
+		if (mprotect(arena->base, committed, PROT_READ | PROT_WRITE) != 0) {
+			return false;
+		}
+		memcpy(arena->base, contents, committed);
+		if (mprotect(arena->base, committed, PROT_READ | PROT_EXEC) != 0) {
+			return false;
+		}
+	}
+
+	munmap(arena->writeBase, CODEPOOL_ARENA_SIZE);
+	arena->writeBase = arena->base;
+	for (pageNum = 0; pageNum < arena->numCommitted; pageNum++) {
+		pageMetaData = arena_page(arena, pageNum);
+		pageMetaData->writePage = pageMetaData->page;
+	}
+	return true;
+}
+
+// The child can't be left writing into its parent's code, or running
+// code that isn't there.
+static void codepool_fork_failed (void) {
+	static const char message[] =
+		"codepool: couldn't give the forked child its own code pages\n";
+
+	if (write(2, message, sizeof(message)-1) < 0) {
+		// nothing more to be done about it
+	}
+	abort();
+}
+
+// A forked child shares the memfd with its parent, so anything either
+// of them wrote would show up in the other's code too. Give the child
+// its own memfd with a copy of everything, mapped at the same addresses.
+// Arenas that can't be moved over get private copies instead.
+static void codepool_fork_child (void) {
+	arena_t* arena;
+	size_t arenaNum, committed;
+	char* contents;
+	int newFd;
+
+	newFd = memfd_create("codepool", MFD_CLOEXEC);
+	if (newFd != -1 && ftruncate(newFd, poolFdSize) != 0) {
+		close(newFd);
+		newFd = -1;
+	}
+
+	for (arenaNum = 0; arenaNum < numArenas; arenaNum++) {
+		arena = arenas[arenaNum];
+		if (arena->writeBase == arena->base) {
+			continue;
+		}
+		committed = arena->numCommitted*pageSize;
+
+		// the parent can go on writing to the pages meanwhile, so copy
+		// them once and use that copy whichever way it goes
+		contents = (char*)malloc(committed + 1);
+		if (contents == NULL) {
+			codepool_fork_failed();
+		}
+		memcpy(contents, arena->base, committed);
+
+		if (   (newFd == -1
+		        || codepool_fork_shared(arena, newFd, contents,
+		                                committed) == false)
+		    && codepool_fork_private(arena, contents, committed) == false) {
+			codepool_fork_failed();
+		}
+		free(contents);
+	}
+
+	// new arenas come out of the new memfd, or are single-mapped if
+	// there isn't one
+	if (poolFd != -1) {
+		close(poolFd);
+	}
+	poolFd = newFd;
+
+	codepool_leave();
+}
+#endif
+
+// must hold the lock
 bool codepool_init (void) {
 	// determine the size of a single page of memory
 	#ifdef WIN32
@@ -165,124 +1097,329 @@ bool codepool_init (void) {
 		pageSize = sysconf(_SC_PAGESIZE);
 	#endif
 
-	// calculate the size of the pageData struct
-	pageDataUnitSize = sizeof(pagedata_t) + pageSize/64;
-	numPageSlices = pageSize/128;
+	// threads give their cached slices back when they exit. If we can't
+	// arrange that, they can still call codepool_flush_cache themselves.
+	#ifdef _WIN32
+		cacheKey = FlsAlloc(codepool_thread_exit);
+	#else
+		cacheKeyCreated = 
+			(pthread_key_create(&cacheKey, codepool_thread_exit) == 0);
+	#endif
+
+	#ifdef CODEPOOL_DUAL_MAP
+		poolFd = memfd_create("codepool", MFD_CLOEXEC);
+		if (poolFd != -1 && codepool_can_exec_fd() == false) {
+			close(poolFd);
+			poolFd = -1;
+		}
+		if (poolFd != -1 && pthread_atfork(codepool_fork_prepare,
+		                                   codepool_fork_parent,
+		                                   codepool_fork_child) != 0) {
+			close(poolFd);
+			poolFd = -1;
+		}
+	#endif
 
-	// add the first page
-	return codepool_addpage();
-}
-// FIXME: We don't allocate pages over word boundaries in the bit
-// fields. Is that okay?
-void* codepool_alloc (size_t newCodeSize) {
+	// calculate the size of the pageData struct, with enough of both
+	// bitfields for a page of the smallest slots
+	bitfieldWords = (pageSize/CODEPOOL_MIN_SLOT + CODEPOOL_WORD_BITS-1)
+	                / CODEPOOL_WORD_BITS;
+	CODEPOOL_STORE_RELEASE(pageDataUnitSize, sizeof(pagedata_t) 
+		+ 2 * bitfieldWords * sizeof(unsigned long long));
 
-	bool doublePage = false;
+	// pages get added as they're needed, since we don't know where
+	// they'll be needed yet.
+	return true;
+}
 
+// Takes a free slot from the first page on the region's free list of a
+// size class. Every page on the list has one, so this never looks at
+// more than one page, however many are full.
+static void* codepool_alloc_in_region (region_t* region, int sizeClass) {
 	pagedata_t* pageMetaData;
-	size_t pageNum,wordNum;
+	size_t wordNum;
 	unsigned char bitNum;
-	unsigned long *bits;
 
-	// ensure parameter is in acceptable range
-	if (newCodeSize > 32) {
-		return false;
+	pageMetaData = region->freePages[sizeClass];
+	if (pageMetaData == NULL) {
+		return NULL;
 	}
-	// is this a double page?
-	if (newCodeSize > 16) {
-		doublePage = true;
-	}	
 
-	// initialize codepool if it has not been already
-	if (pageDataUnitSize == 0) {
-		// some memory failed to init or something?!?
-		if (codepool_init() == false) {
-			return 0;
-		}
+	// find the first word with a free bit in it; the lowest set bit in
+	// that is our slot.
+	for (wordNum = 0; pageMetaData->bitfield[wordNum] == 0; wordNum++);
+	bitNum = sub_first_free(pageMetaData->bitfield[wordNum]);
+	sub_set_allocated(&pageMetaData->bitfield[wordNum], bitNum);
+
+	if (--pageMetaData->numFree == 0) {
+		region_unlink_page(region, pageMetaData);
 	}
-	
-	// we're going to iterate through all the page metadata until we
-	// find a large enough free section. Let's start from the most
-	// recently allocated page. This is probably fastest. maybe.
-	// (who's got time for testing?)
-	for (pageNum = numPages-1; pageNum >= 0; pageNum--) {
-		// Setting up pointer using maths, because we can't use an
-		// array index with variably-sized data
-
-		pageMetaData = (pagedata_t*)((char*)pageMetaDataArray 
-	                                         + pageDataUnitSize*pageNum);
-
-		// now we are going to scan for a free index. We scan one word a
-		// time for a little extra speed.
-		for (wordNum = 0; wordNum < numPageSlices/4; wordNum++) {
-			bits = &pageMetaData->bitfield[wordNum];
-
-			// if none of these bits are marked free, move on
-			// FIXME: this assumes a 32 bit word length, what about x64?
-			if ((*bits&0x55555555) == 0) {
+
+	return sub_to_pointer(pageMetaData,wordNum,bitNum);
+}
+
+// Looks for a free slot in the pages we already have. must hold the lock
+static void* codepool_alloc_in_pool (int sizeClass, void* nearTarget) {
+	size_t regionNum, key;
+	region_t* region;
+	void* code;
+
+	if (nearTarget != NULL) {
+		// only the target's region and its neighbours are close
+		// enough. (wrapping key-1 around at 0 is harmless, no such
+		// region exists.)
+		key = size_t(nearTarget) >> CODEPOOL_REGION_SHIFT;
+		for (regionNum = key-1; regionNum != key+2; regionNum++) {
+			region = codepool_find_region(regionNum);
+			if (region == NULL) {
 				continue;
 			}
+			code = codepool_alloc_in_region(region, sizeClass);
+			if (code != NULL) {
+				return code;
+			}
+		}
+	} else {
+		for (regionNum = 0; regionNum < numRegions; regionNum++) {
+			code = codepool_alloc_in_region(&regions[regionNum], sizeClass);
+			if (code != NULL) {
+				return code;
+			}
+		}
+	}
+	return NULL;
+}
 
-			// There is at least one free page in here, let's look for it.
-			// the weird math in the expression below is so we take into
-			// account a double page's need for two consecutive pages.
-			for (bitNum = 0; bitNum < (4 - doublePage); bitNum++) {
-				if (sub_is_free(*bits,bitNum) == false) {
-					continue;
-				}
+// Takes a slice out of this thread's cache, one near enough to
+// nearTarget if that matters.
+static void* codepool_cache_take (slicecache_t* cache, void* nearTarget) {
+	size_t j;
+	void* code;
 
-				if (doublePage == true) {
-					if (sub_is_free(*bits,bitNum+1) == false) {
-						continue;
-					}
-					// set second pagelet to free=false,dbl=false
-					sub_set_allocated(bits,bitNum+1,false);
-				}
-				sub_set_allocated(bits,bitNum,doublePage);
+	for (j = cache->count; j-- > 0; ) {
+		code = cache->slices[j];
+		if (nearTarget != NULL && codepool_is_near(code, nearTarget) == false) {
+			continue;
+		}
+		cache->slices[j] = cache->slices[--cache->count];
+		codepool_mark_cached(code, false);
+		return code;
+	}
+	return NULL;
+}
+
+// make sure this thread's cache gets flushed when it exits
+static void codepool_cache_register (void) {
+	if (threadCacheRegistered == true) {
+		return;
+	}
+	#ifdef _WIN32
+		if (cacheKey != FLS_OUT_OF_INDEXES) {
+			FlsSetValue(cacheKey, (void*)1);
+		}
+	#else
+		if (cacheKeyCreated == true) {
+			pthread_setspecific(cacheKey, (void*)1);
+		}
+	#endif
+	threadCacheRegistered = true;
+}
+
+// Marks a slot free in its page's bitfield, putting the page back on its
+// region's free list if it was full. must hold the lock
+static void codepool_release_slice (void* codeMemory) {
+	pagedata_t* pageMetaData;
+	unsigned long long* bits;
+	unsigned char bitNum;
+
+	pageMetaData = codepool_index_find(
+		codepool_align_pointer(codeMemory,pageSize));
+	if (pageMetaData == NULL) {
+		return;
+	}
+
+	pointer_to_sub(pageMetaData,codeMemory,&bits,&bitNum);
+	sub_set_free(bits,bitNum);
+	sub_set_cached(bits,bitNum,false);
+
+	if (pageMetaData->numFree++ == 0) {
+		region_link_page(codepool_find_region(
+			size_t(pageMetaData->page) >> CODEPOOL_REGION_SHIFT), pageMetaData);
+	}
+}
 
-				// return its address
-				return sub_to_pointer(pageMetaData,wordNum,bitNum);
+// must not hold the lock
+static void* codepool_alloc_slot (size_t newCodeSize, void* nearTarget) {
+
+	int sizeClass;
+
+	slicecache_t* cache = NULL;
+	void* code = NULL;
+	void* extra;
+	size_t j;
+
+	// initialize codepool if it has not been already (we need to know
+	// the page size to check newCodeSize)
+	if (CODEPOOL_LOAD_ACQUIRE(pageDataUnitSize) == 0) {
+		codepool_enter();
+		if (pageDataUnitSize == 0) {
+			// some memory failed to init or something?!?
+			if (codepool_init() == false) {
+				codepool_leave();
+				return 0;
 			}
 		}
+		codepool_leave();
 	}
-	// There are no free subpages suitable for our purposes,
-	// So let's make a new one!
-	if (codepool_addpage() == false) {
+
+	// ensure parameter is in acceptable range
+	if (newCodeSize == 0 || newCodeSize > pageSize) {
 		return 0;
 	}
+	sizeClass = codepool_size_class(newCodeSize);
+
+	// the cheap way first
+	if (sizeClass != CODEPOOL_CLASS_PAGE) {
+		cache = &threadCache[sizeClass];
+		code = codepool_cache_take(cache, nearTarget);
+		if (code != NULL) {
+			return code;
+		}
+	}
+
+	codepool_enter();
+
+	code = codepool_alloc_in_pool(sizeClass, nearTarget);
+
+	// There are no free slots suitable for our purposes,
+	// So let's make a new page! It goes at the head of its region's
+	// free list, so trying again is O(1)
+	if (code == NULL && codepool_addpage(sizeClass, nearTarget) == true) {
+		code = codepool_alloc_in_pool(sizeClass, nearTarget);
+	}
+
+	// While we have the lock anyway, take a few more slots like this
+	// one so the next allocs on this thread don't need it.
+	if (code != NULL && cache != NULL) {
+		for (j = 0; j < CODEPOOL_CACHE_BATCH 
+		            && cache->count < CODEPOOL_CACHE_SIZE; j++) {
+			extra = codepool_alloc_in_pool(sizeClass, nearTarget);
+			if (extra == NULL) {
+				break;
+			}
+			codepool_mark_cached(extra, true);
+			cache->slices[cache->count++] = extra;
+		}
+	}
+
+	codepool_leave();
+
+	if (cache != NULL && cache->count > 0) {
+		codepool_cache_register();
+	}
+
+	return code;
+}
 
-	// Let's try it all over again. Since we scan the most recently
-	// created pages first, and the new page is entirely free, this
-	// call is O(1)
-	return codepool_alloc(newCodeSize);
+void* codepool_alloc (size_t newCodeSize, void* nearTarget, 
+                      void** writeMemory) {
+	void* code = codepool_alloc_slot(newCodeSize, nearTarget);
+
+	if (code != NULL && writeMemory != NULL) {
+		*writeMemory = codepool_write_pointer(
+			codepool_index_find(codepool_align_pointer(code,pageSize)),
+			code);
+	}
+	return code;
 }
 
 void codepool_free (void* codeMemory) {
-	unsigned long* bits;
+	pagedata_t* pageMetaData;
+	unsigned long long* bits;
 	unsigned char bitNum;
+	slicecache_t* cache;
+	size_t slotSize;
 
 	// it's possible this address isn't actually one of our bridges.
 	// This is because we are smart sometimes and detect when a
 	// real bridge isn't necessary.
-	if (pointer_to_sub(codeMemory,&bits,&bitNum) == false) {
+	pageMetaData = codepool_index_find(
+		codepool_align_pointer(codeMemory,pageSize));
+	if (pageMetaData == NULL) {
 		return;
 	}
+	pointer_to_sub(pageMetaData,codeMemory,&bits,&bitNum);
+	slotSize = codepool_slot_size(pageMetaData->sizeClass);
+
+	codepool_enter();
 
-	// double-free! really bad!
-	if (sub_is_free(*bits,bitNum) == true) {
+	// double-free! really bad! (slices in any thread's cache are still
+	// marked allocated, but they're marked cached too.)
+	if (   sub_is_free(*bits,bitNum) == true
+	    || sub_is_cached(bits,bitNum) == true) {
+		codepool_leave();
 		return;
 	}
+	// mark it cached now rather than once it's in the cache, so a second
+	// free while we're clearing it is caught as well
+	sub_set_cached(bits,bitNum,true);
 
-	codepool_unlock(codeMemory);
+	cache = NULL;
+	if (pageMetaData->sizeClass != CODEPOOL_CLASS_PAGE) {
+		cache = &threadCache[pageMetaData->sizeClass];
+	}
+
+	codepool_page_unlock(pageMetaData);
+	codepool_leave();
 
 	// clear the memory
-	memset(codeMemory, 0xCC, sub_is_dbl(*bits,bitNum) ? 32 : 16);
+	memset(codepool_write_pointer(pageMetaData,codeMemory), 0xCC, slotSize);
 
-	codepool_lock(codeMemory);
-	
-	sub_set_free(bits,bitNum);
+	codepool_enter();
+	codepool_page_lock(pageMetaData);
+
+	// keep it for ourselves, or if the cache is full, give half of it
+	// back along with this one.
+	if (cache != NULL && cache->count < CODEPOOL_CACHE_SIZE) {
+		cache->slices[cache->count++] = codeMemory;
+	} else {
+		codepool_release_slice(codeMemory);
+		while (cache != NULL && cache->count > CODEPOOL_CACHE_SIZE/2) {
+			codepool_release_slice(cache->slices[--cache->count]);
+		}
+	}
+	codepool_leave();
+
+	if (cache != NULL) {
+		codepool_cache_register();
+	}
+}
+
+void codepool_flush_cache (void) {
+	size_t j;
+
+	for (j = 0; j < CODEPOOL_CLASS_PAGE; j++) {
+		if (threadCache[j].count > 0) {
+			break;
+		}
+	}
+	if (j == CODEPOOL_CLASS_PAGE) {
+		return;
+	}
+
+	codepool_enter();
+	for (j = 0; j < CODEPOOL_CLASS_PAGE; j++) {
+		while (threadCache[j].count > 0) {
+			codepool_release_slice(
+				threadCache[j].slices[--threadCache[j].count]);
+		}
+	}
+	codepool_leave();
 }
 
 void codepool_can_write (void* codeMemory, bool canWrite) {
+	CODEPOOL_COUNT(protectionChanges);
+
 	#ifdef _WIN32
 		DWORD oldProtect;
 
@@ -303,10 +1440,105 @@ void codepool_can_write (void* codeMemory, bool canWrite) {
 	#endif
 }
 
+// Pages are shared between threads, so one thread locking a page must
+// not pull it out from under another that is still writing to it. The
+// page stays writeable until the last writer locks it.
 void codepool_lock (void* codeMemory) {
-	codepool_can_write(codeMemory,false);
+	pagedata_t* pageMetaData;
+
+	pageMetaData = codepool_index_find(
+		codepool_align_pointer(codeMemory,pageSize));
+	if (pageMetaData == NULL) {
+		codepool_can_write(codeMemory,false);
+		return;
+	}
+
+	codepool_enter();
+	codepool_page_lock(pageMetaData);
+	codepool_leave();
 }
 
 void codepool_unlock (void* codeMemory) {
-	codepool_can_write(codeMemory,true);
+	pagedata_t* pageMetaData;
+
+	pageMetaData = codepool_index_find(
+		codepool_align_pointer(codeMemory,pageSize));
+	if (pageMetaData == NULL) {
+		codepool_can_write(codeMemory,true);
+		return;
+	}
+
+	codepool_enter();
+	codepool_page_unlock(pageMetaData);
+	codepool_leave();
+}
+
+void codepool_begin_write (void) {
+	txDepth++;
+}
+
+void codepool_commit (void) {
+	size_t j;
+
+	if (txDepth == 0 || --txDepth > 0) {
+		return;
+	}
+
+	codepool_enter();
+	for (j = 0; j < txNumPages; j++) {
+		codepool_page_lock(txPages[j]);
+	}
+	codepool_leave();
+
+	free(txPages);
+	txPages = NULL;
+	txNumPages = 0;
+	txMaxPages = 0;
+}
+
+void codepool_get_stats (codepool_stats_t* stats) {
+	pagedata_t* pageMetaData;
+	size_t arenaNum, pageNum, numSlots, freeBytes = 0;
+	int sizeClass;
+
+	memset(stats, 0, sizeof(*stats));
+
+	codepool_enter();
+
+	stats->pageSize = pageSize;
+	for (sizeClass = 0; sizeClass < CODEPOOL_NUM_CLASSES; sizeClass++) {
+		stats->slotSize[sizeClass] = codepool_slot_size(sizeClass);
+	}
+
+	// nothing's been allocated yet
+	if (pageDataUnitSize == 0) {
+		codepool_leave();
+		stats->protectionChanges = CODEPOOL_LOAD_ACQUIRE(protectionChanges);
+		return;
+	}
+
+	stats->arenas = numArenas;
+	for (arenaNum = 0; arenaNum < numArenas; arenaNum++) {
+		for (pageNum = 0; pageNum < arenas[arenaNum]->numCommitted; pageNum++) {
+			pageMetaData = arena_page(arenas[arenaNum], pageNum);
+			sizeClass = pageMetaData->sizeClass;
+			numSlots = pageSize/codepool_slot_size(sizeClass);
+
+			stats->pages++;
+			stats->pagesBySize[sizeClass]++;
+			stats->slicesInUse[sizeClass] += numSlots - pageMetaData->numFree;
+			stats->slicesFree[sizeClass] += pageMetaData->numFree;
+			if (pageMetaData->numFree == numSlots) {
+				stats->emptyPages++;
+			}
+			freeBytes += pageMetaData->numFree*codepool_slot_size(sizeClass);
+		}
+	}
+
+	codepool_leave();
+
+	if (stats->pages > 0) {
+		stats->fragmentation = (double)freeBytes / (stats->pages*pageSize);
+	}
+	stats->protectionChanges = CODEPOOL_LOAD_ACQUIRE(protectionChanges);
 }
\ No newline at end of file
@@ -19,7 +19,14 @@
  * multiply this consumed memory figure by 50 or 100, and then it becomes
  * clear this is a real issue.
  *
- * This code is NOT thread-safe.
+ * Address space for the pages is reserved CODEPOOL_ARENA_SIZE (2MB by
+ * default, define it to change it) at a time, and pages are committed
+ * out of it as they're needed, so even a pool of thousands of pages is
+ * only a handful of mappings.
+ *
+ * This code is thread-safe. The page lists are kept behind a single
+ * lock, but each thread also keeps a few free slices of its own, so
+ * most allocs and frees never wait on it.
  *
  **/
 
@@ -32,24 +39,39 @@
  * Returns a pointer to a block of memory newCodeSize bytes in length
  * appropriate for dynamically generated code to be written to.
  *
- * Currently, due to how the virtual memory pool is sliced, newCodeSize
- * must be less than 32 bytes.
- *
- * Note that this function does not remove write-protection from the
- * memory page this memory was sliced out of, if it was present. Also,
- * if a new memory page had been allocated the returned memory, it will
- * default to being read-only. Therefore, it is required to use the
- * codepool_unlock and codepool_lock functions before and after writing
- * to this pointer.
+ * Pages are sliced into slots of 16, 32, 64, 128 or 256 bytes, and
+ * newCodeSize is rounded up to the nearest of those. Anything bigger
+ * gets a whole page, so newCodeSize can't be more than the page size.
+ *
+ * The code has to be written through the pointer returned in
+ * writeMemory. On Linux, pages are mapped twice, once executable and
+ * once writeable, and the returned pointer is in the executable view,
+ * which can never be written to. Elsewhere, the two pointers are the
+ * same, and the page is write-protected; this function does not remove
+ * that protection, and a new page defaults to being read-only.
+ * Therefore, it is required to use the codepool_unlock and codepool_lock
+ * functions before and after writing (which cost nothing on dual-mapped
+ * pages).
+ *
+ * If nearTarget is not NULL, the memory returned will be within reach
+ * of a rel32 branch or RIP-relative operand from nearTarget (+/-2GB),
+ * so code written there can jump straight back to the code it came
+ * from. This only matters for 64-bit code; every address is within
+ * reach in 32-bit. When no page near enough can be had, 0 is returned.
  *
  * @param newCodeSize  the size of writeable code to be allocated.
+ * @param nearTarget   the address the memory needs to be near, or NULL
+ *                     if the memory can be anywhere.
+ * @param writeMemory  receives where the code can be written to, may be
+ *                     NULL if it won't be.
  *
  * @return  A pointer to locked memory from the code pool, appropriate
  *          for dynamically generated code.
  *
  **/
 
-void* codepool_alloc (size_t newCodeSize);
+void* codepool_alloc (size_t newCodeSize, void* nearTarget,
+                      void** writeMemory);
 
 /**
  * codepool_free
@@ -61,6 +83,17 @@ void* codepool_alloc (size_t newCodeSize);
 
 void codepool_free (void* codeMemory);
 
+/**
+ * codepool_flush_cache
+ *
+ * Gives the free slices the calling thread has been keeping to itself
+ * back to the pool, where every thread can use them. This happens by
+ * itself when a thread exits, so it's only needed by threads that are
+ * done allocating code but will be sticking around.
+ */
+
+void codepool_flush_cache (void);
+
 /**
  * codepool_lock
  *
@@ -68,6 +101,10 @@ void codepool_free (void* codeMemory);
  * should be called after the dynamically generated code has been written
  * and no more modification is necessary. 
  *
+ * Other threads may be writing to the same page, so the page is only
+ * write-protected once every codepool_unlock on it has been matched by
+ * a codepool_lock.
+ *
  * Write-protecting code is generally a good idea. It allows bugs to be
  * much more quickly noticed (esp. w/ execute disable CPU feature), and
  * it generally makes the pages look normal to antivirus heuristics and
@@ -86,4 +123,79 @@ void codepool_lock (void* codeMemory);
  *
  */
 
-void codepool_unlock (void* codeMemory);
\ No newline at end of file
+void codepool_unlock (void* codeMemory);
+
+/**
+ * codepool_begin_write
+ *
+ * Starts a write transaction on the calling thread. Until the matching
+ * codepool_commit, every page codepool_unlock (or codepool_alloc and
+ * codepool_free, which write to pages themselves) makes writeable stays
+ * writeable, and codepool_lock doesn't protect it again. Each page's
+ * protection is then only changed twice for the whole transaction
+ * instead of twice per write, which adds up when creating or destroying
+ * many bridges at once.
+ *
+ * Transactions can be nested, only the outermost commit counts.
+ */
+
+void codepool_begin_write (void);
+
+/**
+ * codepool_commit
+ *
+ * Ends the calling thread's write transaction, write-protecting every
+ * page that was written to during it.
+ */
+
+void codepool_commit (void);
+
+/**
+ * CODEPOOL_NUM_SIZES
+ *
+ * How many sizes of slot pages are cut up into: 16 to 256 bytes, and
+ * whole pages for anything bigger.
+ */
+#define CODEPOOL_NUM_SIZES 6
+
+/**
+ * codepool_stats_t
+ *
+ * A snapshot of the code pool, for codepool_get_stats. The per-size
+ * arrays go from the smallest slots up to whole pages.
+ */
+struct codepool_stats_t {
+	// address space reserved, and pages committed out of it
+	size_t arenas;
+	size_t pages;
+	size_t pageSize;
+
+	// for each size, how big its slots are, how many pages are cut up
+	// into them, and how many of those slots are in use and free.
+	// Slices threads are keeping in their caches count as in use.
+	size_t slotSize[CODEPOOL_NUM_SIZES];
+	size_t pagesBySize[CODEPOOL_NUM_SIZES];
+	size_t slicesInUse[CODEPOOL_NUM_SIZES];
+	size_t slicesFree[CODEPOOL_NUM_SIZES];
+
+	// pages with nothing in use at all. Pages are never given back, and
+	// stay cut up for whatever size they were first used for.
+	size_t emptyPages;
+	// the fraction of the committed memory that's in free slots
+	double fragmentation;
+
+	// VirtualProtect/mprotect calls made so far, counting committing
+	// pages
+	unsigned long long protectionChanges;
+};
+
+/**
+ * codepool_get_stats
+ *
+ * Takes a snapshot of how much memory the pool has and how it's being
+ * used. This goes through every page under the pool's lock, so it's
+ * meant for checking on now and then, not for every allocation.
+ *
+ * @param stats  Receives the statistics.
+ */
+void codepool_get_stats (codepool_stats_t* stats);